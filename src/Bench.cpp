@@ -0,0 +1,754 @@
+#include "Image.h"
+#include "FilmGrain.h"
+#include "Golden.h"
+#include "LUTs.h"
+#include "MicroBench.h"
+#include "Parallel.h"
+#include "PerfCounters.h"
+#include "Util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C"
+{
+    #include "flag.h"
+}
+
+#define ARRAYSIZE(_ARR) ((int)(sizeof(_ARR) / sizeof(*_ARR)))
+
+#ifndef DSIP_DATA_DIR
+#define DSIP_DATA_DIR "data"
+#endif
+
+#ifndef DSIP_GOLDEN_DIR
+#define DSIP_GOLDEN_DIR "golden"
+#endif
+
+#ifndef DSIP_GOLDEN_TIMINGS
+#define DSIP_GOLDEN_TIMINGS "golden-timings.txt"
+#endif
+
+struct BenchOptions
+{
+    const char* Data;
+    const char* Json;
+    const char* Sizes;
+    const char* Stages;
+    int MinTime;
+    int MinIterations;
+    int LUTIndex;
+    bool Micro;
+    bool Counters;
+    bool Golden;
+    const char* GoldenDirectory;
+    const char* GoldenTimings;
+    bool GoldenUpdate;
+    int MinPSNR;
+    int MaxError;
+    int Margin;
+    const char* Precision;
+    bool PrecisionReport;
+    bool Memoize;
+    int Palette;
+    int Threads;
+    bool Greyscale;
+    bool DedupReport;
+    const char* LUTBudget;
+    bool LatticeReport;
+};
+
+struct BenchResult
+{
+    std::string Image;
+    std::string Stage;
+    int32_t Width;
+    int32_t Height;
+    std::vector<double> Samples;
+    PerfCounters::CounterSample Counters;
+};
+
+struct PixelStage
+{
+    const char* Name;
+    int Filters;
+};
+
+static const PixelStage PixelStages[] = {
+    { "convert",    0 },
+    { "lut",        Image::ProcessFilterLUT },
+    { "hsv",        Image::ProcessFilterHSV },
+    { "contrast",   Image::ProcessFilterBrightness | Image::ProcessFilterContrast },
+    { "grain",      Image::ProcessFilterGrain },
+    { "vignette",   Image::ProcessFilterVignette },
+    { "pipeline",   Image::ProcessFilterLUT | Image::ProcessFilterAll },
+};
+
+double Percentile(std::vector<double> samples, double percentile)
+{
+    if (samples.empty()) return 0.0;
+
+    std::sort(samples.begin(), samples.end());
+    size_t index = std::min(samples.size() - 1, (size_t)std::ceil(percentile * samples.size()) - 1);
+    return samples[index];
+}
+
+double IPC(const PerfCounters::CounterSample& counters)
+{
+    if (!counters.Available[PerfCounters::CounterCycles] || !counters.Available[PerfCounters::CounterInstructions]) return 0.0;
+    if (counters.Values[PerfCounters::CounterCycles] == 0.0) return 0.0;
+
+    return counters.Values[PerfCounters::CounterInstructions] / counters.Values[PerfCounters::CounterCycles];
+}
+
+bool StageEnabled(const BenchOptions& options, const char* stage)
+{
+    if (!options.Stages) return true;
+
+    std::stringstream stages(options.Stages);
+    std::string item;
+
+    while (std::getline(stages, item, ','))
+    {
+        if (item == stage) return true;
+    }
+
+    return false;
+}
+
+// Runs once to warm up, then repeats until both the minimum run count and the
+// minimum time are reached, recording the latency of every run
+BenchResult Measure(const BenchOptions& options, const std::string& image, int32_t width, int32_t height, const char* stage, const std::function<void()>& run)
+{
+    using Clock = std::chrono::steady_clock;
+
+    BenchResult result;
+    result.Image = image;
+    result.Stage = stage;
+    result.Width = width;
+    result.Height = height;
+
+    run();
+
+    double total = 0.0;
+
+    if (options.Counters) PerfCounters::Start();
+
+    while (total * 1000.0 < options.MinTime || (int)result.Samples.size() < options.MinIterations)
+    {
+        auto start = Clock::now();
+        run();
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        result.Samples.push_back(elapsed);
+        total += elapsed;
+    }
+
+    double pixels = (double)width * height;
+    double p50 = Percentile(result.Samples, 0.5);
+
+    printf("%-8s %-10s %10.2f %10.2f %10.3f %10.3f %6d", image.c_str(), stage,
+        pixels / p50 * 1e-6, p50 / pixels * 1e9, p50 * 1e3, Percentile(result.Samples, 0.99) * 1e3, (int)result.Samples.size());
+
+    if (options.Counters)
+    {
+        PerfCounters::Stop(result.Counters);
+
+        // Counts cover every timed run, report them per pixel of a single run
+        for (double& value : result.Counters.Values)
+        {
+            value /= result.Samples.size() * pixels;
+        }
+
+        const PerfCounters::CounterSample& counters = result.Counters;
+
+        printf(" %6.2f", IPC(counters));
+
+        for (int counter : { PerfCounters::CounterL1Misses, PerfCounters::CounterLLCMisses, PerfCounters::CounterBranchMisses })
+        {
+            if (counters.Available[counter])
+            {
+                printf(" %10.4f", counters.Values[counter]);
+            }
+            else
+            {
+                printf(" %10s", "-");
+            }
+        }
+    }
+
+    printf("\n");
+    fflush(stdout);
+
+    return result;
+}
+
+// Smooth gradients with some noise, so that PNG encode and decode see
+// photo-like rather than trivially compressible content. A non zero palette
+// size quantizes it to that many colours, like a screenshot or flat artwork.
+void GenerateImage(int32_t width, int32_t height, int32_t palette, std::vector<uint8_t>& pixels)
+{
+    pixels.resize(width * height * 3);
+
+    uint32_t noise = 0x12345678;
+
+    for (int32_t i = 0; i < height; ++i)
+    {
+        for (int32_t j = 0; j < width; ++j)
+        {
+            float u = (float)j / width;
+            float v = (float)i / height;
+            uint8_t* pixel = &pixels[(i * width + j) * 3];
+
+            noise = noise * 1664525u + 1013904223u;
+
+            pixel[0] = (uint8_t)std::min(255.0f, 255.0f * u + (noise >> 28));
+            pixel[1] = (uint8_t)std::min(255.0f, 255.0f * v + ((noise >> 24) & 0xf));
+            pixel[2] = (uint8_t)std::min(255.0f, 127.0f + 120.0f * std::sin(u * 12.0f + v * 5.0f) + ((noise >> 20) & 0xf));
+        }
+    }
+
+    if (palette <= 0) return;
+
+    // Levels per channel so that levels^3 covers the palette
+    int levels = std::max(2, (int)std::ceil(std::cbrt((double)palette)));
+
+    for (uint8_t& value : pixels)
+    {
+        value = (uint8_t)(value * (levels - 1) / 255 * 255 / (levels - 1));
+    }
+}
+
+// CIE76 colour difference, through the Lab conversion the LUT budget measures
+// with
+double DeltaE(const uint8_t* rgb0, const uint8_t* rgb1)
+{
+    float colour0[3] = { rgb0[0] / 255.0f, rgb0[1] / 255.0f, rgb0[2] / 255.0f };
+    float colour1[3] = { rgb1[0] / 255.0f, rgb1[1] / 255.0f, rgb1[2] / 255.0f };
+    float lab0[3], lab1[3];
+
+    Image::SRGBToLab(colour0, lab0);
+    Image::SRGBToLab(colour1, lab1);
+
+    double dl = (double)lab0[0] - lab1[0];
+    double da = (double)lab0[1] - lab1[1];
+    double db = (double)lab0[2] - lab1[2];
+
+    return std::sqrt(dl * dl + da * da + db * db);
+}
+
+// Acquires every file of a list with identical contents next to each other,
+// so that each duplicate finds the first copy still in the asset cache, and
+// lists the names that share a decoded asset
+void AcquireByContent(const char* const* files, int count, const std::function<bool(const char*)>& acquire)
+{
+    std::vector<std::pair<uint64_t, const char*>> hashes;
+
+    for (int i = 0; i < count; ++i)
+    {
+        std::vector<char> data = Util::BytesFromFile(files[i]);
+        hashes.emplace_back(Util::Hash(data.data(), data.size()), files[i]);
+    }
+
+    std::stable_sort(hashes.begin(), hashes.end(), [](const std::pair<uint64_t, const char*>& a, const std::pair<uint64_t, const char*>& b)
+    {
+        return a.first < b.first;
+    });
+
+    for (size_t i = 0; i < hashes.size(); ++i)
+    {
+        if (!acquire(hashes[i].second))
+        {
+            fprintf(stderr, "Failed to load %s\n", hashes[i].second);
+            continue;
+        }
+
+        if (i > 0 && hashes[i].first == hashes[i - 1].first)
+        {
+            printf("  %s = %s\n", hashes[i].second, hashes[i - 1].second);
+        }
+    }
+}
+
+bool DedupReport()
+{
+    printf("identical assets:\n");
+
+    AcquireByContent(LUTs, ARRAYSIZE(LUTs), [](const char* path) { return Image::AcquireLUT(path) != nullptr; });
+    AcquireByContent(FilmGrain, ARRAYSIZE(FilmGrain), [](const char* path) { return Image::AcquireGrain(path) != nullptr; });
+
+    Image::AssetStats luts, grains;
+    Image::GetAssetStats(luts, grains);
+
+    printf("\n%-8s %8s %8s %8s %12s\n", "asset", "files", "decoded", "shared", "saved MB");
+    printf("%-8s %8d %8llu %8llu %12.2f\n", "lut", ARRAYSIZE(LUTs), (unsigned long long)luts.Decoded, (unsigned long long)luts.Shared, luts.SavedBytes / 1048576.0);
+    printf("%-8s %8d %8llu %8llu %12.2f\n", "grain", ARRAYSIZE(FilmGrain), (unsigned long long)grains.Decoded, (unsigned long long)grains.Shared, grains.SavedBytes / 1048576.0);
+
+    return true;
+}
+
+// Loads every LUT of LUTs[] under the error budget and lists the lattice each
+// one kept
+bool LatticeReport()
+{
+    std::map<uint32_t, int> sizes;
+    uint64_t loaded_bytes = 0;
+
+    printf("%-48s %6s %-12s %10s\n", "lut", "size", "class", "KB");
+
+    for (const char* path : LUTs)
+    {
+        Image::LUTDesc lut;
+
+        if (!Image::LoadLUT(path, lut))
+        {
+            fprintf(stderr, "Failed to load %s\n", path);
+            return false;
+        }
+
+        printf("%-48s %6u %-12s %10.1f\n", path, lut.Size, Image::LUTClassName(lut.Class), Image::DecodedSize(lut) / 1024.0);
+
+        sizes[lut.Size]++;
+        loaded_bytes += Image::DecodedSize(lut);
+    }
+
+    printf("\n%6s %8s\n", "size", "luts");
+
+    for (const auto& size : sizes)
+    {
+        printf("%6u %8d\n", size.first, size.second);
+    }
+
+    printf("\ndecoded %.2f MB\n", loaded_bytes / 1048576.0);
+
+    return true;
+}
+
+// Times the whole pipeline in every precision mode and reports how far each
+// lands from exact, as delta-E over every LUT of LUTs[]
+bool PrecisionReport(const BenchOptions& options, const Image::ProcessParams& process_params, const Image::LUTDesc& lut, const Image::ImageData& grain)
+{
+    const Image::ProcessPrecision precisions[] = { Image::ProcessPrecisionExact, Image::ProcessPrecisionBalanced, Image::ProcessPrecisionFast, Image::ProcessPrecisionFixed };
+    const int32_t width = 256;
+    const int32_t height = 192;
+
+    std::vector<uint8_t> pixels;
+    GenerateImage(width, height, options.Palette, pixels);
+
+    Image::ImageData image;
+    image.Pixels = pixels.data();
+    image.Width = width;
+    image.Height = height;
+    image.Comp = 3;
+
+    std::vector<double> max_delta(ARRAYSIZE(precisions), 0.0);
+    std::vector<double> sum_delta(ARRAYSIZE(precisions), 0.0);
+
+    for (int lut_index = 0; lut_index < ARRAYSIZE(LUTs); ++lut_index)
+    {
+        Image::LUTDesc report_lut;
+
+        if (!Image::LoadLUT(LUTs[lut_index], report_lut))
+        {
+            fprintf(stderr, "Failed to load %s\n", LUTs[lut_index]);
+            return false;
+        }
+
+        Image::ProcessParams report_params = process_params;
+        report_params.LUTFile = LUTs[lut_index];
+        report_params.LUTIndex = lut_index;
+        report_params.Precision = Image::ProcessPrecisionExact;
+
+        Image::ImageDesc exact;
+        exact.Data = image;
+        Image::ProcessImage(exact, report_params, report_lut, grain);
+
+        for (int p = 1; p < ARRAYSIZE(precisions); ++p)
+        {
+            report_params.Precision = precisions[p];
+
+            Image::ImageDesc approximate;
+            approximate.Data = image;
+            Image::ProcessImage(approximate, report_params, report_lut, grain);
+
+            for (int32_t i = 0; i < width * height; ++i)
+            {
+                double delta = DeltaE(&exact.ScratchData[i * 3], &approximate.ScratchData[i * 3]);
+
+                max_delta[p] = std::max(max_delta[p], delta);
+                sum_delta[p] += delta;
+            }
+        }
+    }
+
+    double pixel_count = (double)width * height * ARRAYSIZE(LUTs);
+
+    printf("%-8s %-10s %10s %10s %10s %10s %6s\n", "image", "stage", "MP/s", "ns/px", "p50 ms", "p99 ms", "runs");
+
+    std::vector<double> ns_per_pixel;
+
+    for (Image::ProcessPrecision precision : precisions)
+    {
+        Image::ProcessParams timed_params = process_params;
+        timed_params.Precision = precision;
+
+        std::string stage = std::string("pipeline-") + Image::PrecisionName(precision);
+        std::vector<uint8_t> timed_pixels;
+        GenerateImage(1024, 768, options.Palette, timed_pixels);
+
+        Image::ImageData timed_image = image;
+        timed_image.Pixels = timed_pixels.data();
+        timed_image.Width = 1024;
+        timed_image.Height = 768;
+
+        BenchResult result = Measure(options, "0.8MP", 1024, 768, stage.c_str(), [&]()
+        {
+            Image::ImageDesc processed;
+            processed.Data = timed_image;
+            Image::ProcessImage(processed, timed_params, lut, grain);
+        });
+
+        ns_per_pixel.push_back(Percentile(result.Samples, 0.5) / (1024.0 * 768.0) * 1e9);
+    }
+
+    printf("\n%-10s %10s %10s %12s %12s\n", "precision", "ns/px", "speedup", "mean dE76", "max dE76");
+
+    for (int p = 0; p < ARRAYSIZE(precisions); ++p)
+    {
+        printf("%-10s %10.2f %9.2fx %12.4f %12.4f\n", Image::PrecisionName(precisions[p]), ns_per_pixel[p],
+            ns_per_pixel[0] / ns_per_pixel[p], sum_delta[p] / pixel_count, max_delta[p]);
+    }
+
+    return true;
+}
+
+bool WriteJson(const char* path, const std::vector<BenchResult>& results, bool counters)
+{
+    FILE* file = fopen(path, "w");
+
+    if (!file) return false;
+
+    fprintf(file, "{\n  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& result = results[i];
+        double pixels = (double)result.Width * result.Height;
+        double p50 = Percentile(result.Samples, 0.5);
+
+        fprintf(file, "    {\"image\": \"%s\", \"stage\": \"%s\", \"width\": %d, \"height\": %d, "
+            "\"mp_per_s\": %.4f, \"ns_per_pixel\": %.4f, \"p50_ms\": %.4f, \"p99_ms\": %.4f, \"iterations\": %d",
+            result.Image.c_str(), result.Stage.c_str(), result.Width, result.Height,
+            pixels / p50 * 1e-6, p50 / pixels * 1e9, p50 * 1e3, Percentile(result.Samples, 0.99) * 1e3,
+            (int)result.Samples.size());
+
+        if (counters)
+        {
+            fprintf(file, ", \"ipc\": %.4f", IPC(result.Counters));
+
+            for (int j = 0; j < PerfCounters::CounterCount; ++j)
+            {
+                if (!result.Counters.Available[j]) continue;
+
+                fprintf(file, ", \"%s_per_pixel\": %.6f", PerfCounters::Name((PerfCounters::Counter)j), result.Counters.Values[j]);
+            }
+        }
+
+        fprintf(file, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+
+    return true;
+}
+
+// Output paths are given relative to where the bench was started, not to the
+// data directory it runs from
+std::string ResolvePath(const std::string& directory, const char* path)
+{
+    if (path[0] == '/' || directory.empty()) return path;
+
+    return directory + "/" + path;
+}
+
+int main(int argc, const char** argv)
+{
+    BenchOptions options = {};
+    options.Data = DSIP_DATA_DIR;
+    options.GoldenDirectory = DSIP_GOLDEN_DIR;
+    options.GoldenTimings = DSIP_GOLDEN_TIMINGS;
+    options.Sizes = "0.3,2,12,24,50,100";
+    options.MinTime = 500;
+    options.MinIterations = 5;
+    options.MinPSNR = 45;
+    options.MaxError = 2;
+    options.Margin = 10;
+    options.Precision = "exact";
+
+    flag_usage("[options]");
+
+    flag_string(&options.Data, "data", "Directory holding the LUT and grain assets");
+    flag_string(&options.Json, "json", "Write the results as JSON to this path");
+    flag_string(&options.Sizes, "sizes", "Synthetic image sizes in megapixels");
+    flag_string(&options.Stages, "stages", "Comma separated stages to run, all by default");
+    flag_int(&options.MinTime, "min-time", "Minimum time per measurement in ms");
+    flag_int(&options.MinIterations, "min-iterations", "Minimum runs per measurement");
+    flag_int(&options.LUTIndex, "lut", "Index in LUTs[] of the look to benchmark");
+    flag_bool(&options.Micro, "micro", "Time the colour kernels in isolation instead");
+    flag_bool(&options.Counters, "counters", "Read hardware performance counters around each stage (Linux)");
+
+    flag_bool(&options.Golden, "golden", "Compare every LUT and profile against the golden outputs and timings");
+    flag_string(&options.GoldenDirectory, "golden-dir", "Directory of the golden outputs, the ones checked into the repository by default");
+    flag_string(&options.GoldenTimings, "golden-timings", "Throughput baseline of this machine, recorded by the first --golden run");
+    flag_bool(&options.GoldenUpdate, "golden-update", "Write the golden outputs and timings instead of comparing");
+    flag_int(&options.MinPSNR, "min-psnr", "Lowest PSNR in dB accepted against a golden output");
+    flag_int(&options.MaxError, "max-error", "Largest per channel difference accepted against a golden output");
+    flag_int(&options.Margin, "margin", "Throughput regression in percent accepted against the golden timings");
+
+    flag_string(&options.Precision, "precision", "Pipeline precision to measure, exact, balanced, fast or fixed");
+    flag_bool(&options.PrecisionReport, "precision-report", "Compare the speed and delta-E of every precision against exact");
+    flag_bool(&options.DedupReport, "dedup-report", "Load every LUT and grain frame and report the identical ones sharing a decoded copy");
+    flag_string(&options.LUTBudget, "lut-budget", "Load LUTs onto the smallest lattice within this delta-E of the original, e.g. 0.5");
+    flag_bool(&options.LatticeReport, "lattice-report", "Load every LUT under --lut-budget and report the lattice sizes kept");
+    flag_bool(&options.Memoize, "memoize", "Reuse colour results for repeated input colours and report the hit rate");
+    flag_bool(&options.Greyscale, "greyscale", "Encode grey end to end results as greyscale PNGs");
+    flag_int(&options.Palette, "palette", "Quantize the synthetic images to about this many colours");
+    flag_int(&options.Threads, "threads", "Worker threads processing the tiles of each image, 1 for single core costs, all cores by default");
+
+    flag_parse(argc, argv, "v" "0.1.0", 0);
+
+    // Every measurement takes at least one sample
+    options.MinTime = std::max(1, options.MinTime);
+    options.MinIterations = std::max(1, options.MinIterations);
+
+    if (options.Threads > 0) Parallel::SetWorkerCount(options.Threads);
+
+    char working_directory[4096];
+    std::string start_directory = getcwd(working_directory, sizeof(working_directory)) ? working_directory : "";
+    std::string json_path = options.Json ? ResolvePath(start_directory, options.Json) : "";
+    std::string golden_path = ResolvePath(start_directory, options.GoldenDirectory);
+    std::string timings_path = ResolvePath(start_directory, options.GoldenTimings);
+
+    if (chdir(options.Data) != 0)
+    {
+        fprintf(stderr, "Failed to enter data directory %s\n", options.Data);
+        return EXIT_FAILURE;
+    }
+
+    options.Json = options.Json ? json_path.c_str() : nullptr;
+
+    Image::ProcessPrecision precision;
+
+    if (!Image::ParsePrecision(options.Precision, precision))
+    {
+        fprintf(stderr, "Unknown precision %s, expected exact, balanced, fast or fixed\n", options.Precision);
+        return EXIT_FAILURE;
+    }
+
+    if (options.LUTBudget)
+    {
+        Image::SetLUTErrorBudget((float)atof(options.LUTBudget));
+    }
+
+    if (options.LatticeReport)
+    {
+        return LatticeReport() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (options.DedupReport)
+    {
+        return DedupReport() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (options.Golden)
+    {
+        Golden::GoldenOptions golden_options;
+        golden_options.Directory = golden_path.c_str();
+        golden_options.Timings = timings_path.c_str();
+        golden_options.Update = options.GoldenUpdate;
+        golden_options.MinPSNR = options.MinPSNR;
+        golden_options.MaxError = options.MaxError;
+        golden_options.Margin = options.Margin;
+        golden_options.Precision = precision;
+
+        return Golden::Run(golden_options) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    Image::ProcessParams process_params;
+    process_params.LUTFile = LUTs[std::max(0, std::min(options.LUTIndex, ARRAYSIZE(LUTs) - 1))];
+    process_params.LUTIndex = options.LUTIndex;
+    process_params.GrainFile = FilmGrain[0];
+    process_params.LUTStrength = 0.8f;
+    process_params.GrainStrength = 0.3f;
+    process_params.VignetteStrength = 0.5f;
+    process_params.Hue = 0.95f;
+    process_params.Saturation = 0.9f;
+    process_params.Brightness = 0.02f;
+    process_params.Contrast = 1.05f;
+    process_params.Precision = precision;
+    process_params.Memoize = options.Memoize;
+
+    Image::LUTDesc lut;
+    Image::ImageData grain;
+
+    if (!Image::LoadLUT(process_params.LUTFile, lut) || !Image::LoadImage(process_params.GrainFile, grain))
+    {
+        fprintf(stderr, "Failed to load %s or %s\n", process_params.LUTFile, process_params.GrainFile);
+        return EXIT_FAILURE;
+    }
+
+    if (options.PrecisionReport)
+    {
+        bool res = PrecisionReport(options, process_params, lut, grain);
+        Image::FreeImage(grain);
+        return res ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (options.Micro)
+    {
+        Image::FreeImage(grain);
+        return MicroBench::Run(lut, options.Json) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    std::vector<BenchResult> results;
+
+    if (options.Counters && !PerfCounters::Open())
+    {
+        fprintf(stderr, "Hardware counters unavailable, reporting wall time only\n");
+        options.Counters = false;
+    }
+
+    printf("%-8s %-10s %10s %10s %10s %10s %6s", "image", "stage", "MP/s", "ns/px", "p50 ms", "p99 ms", "runs");
+
+    if (options.Counters)
+    {
+        printf(" %6s %10s %10s %10s", "IPC", "L1D/px", "LLC/px", "branch/px");
+    }
+
+    printf("\n");
+
+    if (StageEnabled(options, "lut_prepare"))
+    {
+        int lut_index = 0;
+        int32_t lut_size = std::lround(std::pow(lut.Level, 3));
+
+        results.push_back(Measure(options, "lut", lut_size, lut_size, "lut_prepare", [&]()
+        {
+            Image::LUTDesc prepared_lut;
+            Image::LoadLUT(LUTs[lut_index++ % ARRAYSIZE(LUTs)], prepared_lut);
+        }));
+    }
+
+    std::stringstream sizes(options.Sizes);
+    std::string size;
+
+    while (std::getline(sizes, size, ','))
+    {
+        double megapixels = atof(size.c_str());
+
+        if (megapixels <= 0.0) continue;
+
+        std::string name = size + "MP";
+
+        Image::ImageDesc source;
+        source.Data.Width = std::lround(std::sqrt(megapixels * 1e6 * 4.0 / 3.0));
+        source.Data.Height = std::lround(source.Data.Width * 3.0 / 4.0);
+        source.Data.Comp = 3;
+
+        int32_t width = source.Data.Width;
+        int32_t height = source.Data.Height;
+
+        std::vector<uint8_t> pixels;
+        GenerateImage(width, height, options.Palette, pixels);
+        source.ScratchData = new uint8_t[pixels.size()];
+        std::copy(pixels.begin(), pixels.end(), source.ScratchData);
+
+        std::vector<char> encoded;
+        Image::EncodeImage(source, encoded);
+
+        Image::ImageData image;
+        Image::DecodeImage(encoded, image);
+
+        if (StageEnabled(options, "decode"))
+        {
+            results.push_back(Measure(options, name, width, height, "decode", [&]()
+            {
+                Image::ImageData decoded;
+                Image::DecodeImage(encoded, decoded);
+                Image::FreeImage(decoded);
+            }));
+        }
+
+        for (const PixelStage& stage : PixelStages)
+        {
+            if (!StageEnabled(options, stage.Name)) continue;
+
+            Image::ProcessParams stage_params = process_params;
+            stage_params.Filters = stage.Filters;
+
+            results.push_back(Measure(options, name, width, height, stage.Name, [&]()
+            {
+                Image::ImageDesc processed;
+                processed.Data = image;
+                Image::ProcessImage(processed, stage_params, lut, grain);
+            }));
+        }
+
+        if (StageEnabled(options, "encode"))
+        {
+            std::vector<char> output;
+
+            results.push_back(Measure(options, name, width, height, "encode", [&]()
+            {
+                Image::EncodeImage(source, output);
+            }));
+        }
+
+        if (StageEnabled(options, "end_to_end"))
+        {
+            results.push_back(Measure(options, name, width, height, "end_to_end", [&]()
+            {
+                Image::ImageDesc processed;
+                Image::DecodeImage(encoded, processed.Data);
+                Image::ProcessImage(processed, process_params, lut, grain);
+
+                std::vector<char> output;
+                Image::EncodeImage(processed, output, options.Greyscale);
+
+                Image::FreeImage(processed.Data);
+            }));
+        }
+
+        Image::FreeImage(image);
+    }
+
+    Image::FreeImage(grain);
+
+    if (options.Memoize)
+    {
+        uint64_t lookups, hits;
+        Image::ColourCacheStats(lookups, hits);
+        printf("\ncolour cache: %llu lookups, %.1f%% hits\n", (unsigned long long)lookups, lookups ? 100.0 * hits / lookups : 0.0);
+    }
+
+    if (options.Counters) PerfCounters::Close();
+
+    if (options.Json && !WriteJson(options.Json, results, options.Counters))
+    {
+        fprintf(stderr, "Failed to write %s\n", options.Json);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+#include "ContactSheet.h"
+#include "LUTs.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <sys/stat.h>
+
+#define ARRAYSIZE(_ARR) ((int)(sizeof(_ARR) / sizeof(*_ARR)))
+
+namespace ContactSheet
+{
+
+static const int GlyphWidth = 5;
+static const int GlyphHeight = 7;
+static const int LabelHeight = GlyphHeight + 6;
+static const int CellPadding = 4;
+
+static const char GlyphCharacters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.";
+
+// 5x7 bitmap font, one byte per row with the leftmost pixel in bit 4
+static const uint8_t Glyphs[][GlyphHeight] = {
+    {0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11}, // A
+    {0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E}, // B
+    {0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E}, // C
+    {0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C}, // D
+    {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F}, // E
+    {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10}, // F
+    {0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F}, // G
+    {0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11}, // H
+    {0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E}, // I
+    {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C}, // J
+    {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, // K
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F}, // L
+    {0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11}, // M
+    {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11}, // N
+    {0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, // O
+    {0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10}, // P
+    {0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D}, // Q
+    {0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11}, // R
+    {0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E}, // S
+    {0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}, // T
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, // U
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04}, // V
+    {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A}, // W
+    {0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11}, // X
+    {0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04}, // Y
+    {0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F}, // Z
+    {0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E}, // 0
+    {0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E}, // 1
+    {0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F}, // 2
+    {0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E}, // 3
+    {0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02}, // 4
+    {0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E}, // 5
+    {0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E}, // 6
+    {0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}, // 7
+    {0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E}, // 8
+    {0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C}, // 9
+    {0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00}, // -
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F}, // _
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C}, // .
+};
+
+void DrawLabel(Image::ImageDesc& sheet, int32_t x, int32_t y, int32_t max_width, const std::string& label)
+{
+    int32_t max_characters = max_width / (GlyphWidth + 1);
+
+    for (int32_t c = 0; c < (int32_t)label.size() && c < max_characters; ++c)
+    {
+        const char* character = strchr(GlyphCharacters, toupper(label[c]));
+
+        if (!character || *character == '\0') continue;
+
+        const uint8_t* glyph = Glyphs[character - GlyphCharacters];
+
+        for (int32_t i = 0; i < GlyphHeight; ++i)
+        {
+            for (int32_t j = 0; j < GlyphWidth; ++j)
+            {
+                if (!(glyph[i] & (1 << (GlyphWidth - 1 - j)))) continue;
+
+                int32_t pixel_index = ((y + i) * sheet.Data.Width + x + c * (GlyphWidth + 1) + j) * sheet.Data.Comp;
+                std::memset(sheet.ScratchData + pixel_index, 0xdd, sheet.Data.Comp);
+            }
+        }
+    }
+}
+
+void CopyToCell(Image::ImageDesc& sheet, int32_t x, int32_t y, const Image::ImageDesc& thumbnail)
+{
+    for (int32_t i = 0; i < thumbnail.Data.Height; ++i)
+    {
+        for (int32_t j = 0; j < thumbnail.Data.Width; ++j)
+        {
+            const uint8_t* input = thumbnail.ScratchData + (i * thumbnail.Data.Width + j) * Image::OutputComp(thumbnail.Data.Comp);
+            uint8_t* output = sheet.ScratchData + ((y + i) * sheet.Data.Width + x + j) * sheet.Data.Comp;
+
+            std::memcpy(output, input, sheet.Data.Comp);
+        }
+    }
+}
+
+bool Render(const Image::ImageData& image, const Image::ProcessParams& process_params, const char* output_directory, int32_t thumbnail_size)
+{
+    if (mkdir(output_directory, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Failed to create directory %s\n", output_directory);
+        return false;
+    }
+
+    auto grain = Image::AcquireGrain(process_params.GrainFile);
+
+    if (!grain) return false;
+
+    // Downscale the source once, every look is rendered from the same proxy
+    std::vector<uint8_t> proxy_pixels;
+
+    Image::ImageData proxy;
+    proxy.Comp = image.Comp;
+    Image::FitSize(image.Width, image.Height, thumbnail_size, proxy.Width, proxy.Height);
+
+    proxy_pixels.resize(proxy.Width * proxy.Height * proxy.Comp);
+    proxy.Pixels = proxy_pixels.data();
+
+    Image::ResizePixels(image.Pixels, image.Width, image.Height, image.Comp, proxy.Pixels, proxy.Width, proxy.Height);
+
+    int32_t lut_count = ARRAYSIZE(LUTs);
+    int32_t columns = (int32_t)std::ceil(std::sqrt((float)lut_count));
+    int32_t rows = (lut_count + columns - 1) / columns;
+    int32_t cell_width = proxy.Width + CellPadding;
+    int32_t cell_height = proxy.Height + LabelHeight + CellPadding;
+
+    Image::ImageDesc sheet;
+    sheet.Data.Width = columns * cell_width + CellPadding;
+    sheet.Data.Height = rows * cell_height + CellPadding;
+    sheet.Data.Comp = std::min(Image::OutputComp(proxy.Comp), 3);
+    sheet.ScratchData = new uint8_t[sheet.Data.Width * sheet.Data.Height * sheet.Data.Comp];
+
+    std::memset(sheet.ScratchData, 0x20, sheet.Data.Width * sheet.Data.Height * sheet.Data.Comp);
+
+    std::vector<char> results(lut_count, false);
+
+    // Looks are loaded outside of the asset cache, a full sweep would only
+    // evict the entries other callers are working with
+    Parallel::For(lut_count, [&](int lut_index)
+    {
+        Image::LUTDesc lut;
+
+        if (!Image::LoadLUT(LUTs[lut_index], lut)) return;
+
+        Image::ProcessParams thumbnail_params = process_params;
+        thumbnail_params.LUTFile = LUTs[lut_index];
+        thumbnail_params.LUTIndex = lut_index;
+
+        Image::ImageDesc thumbnail;
+        thumbnail.Data = proxy;
+
+        Image::ProcessImage(thumbnail, thumbnail_params, lut, *grain);
+
+        std::string name(LUTs[lut_index]);
+        std::string path = std::string(output_directory) + "/" + name;
+
+        results[lut_index] = Image::SaveImage(path.c_str(), thumbnail);
+
+        int32_t x = CellPadding + (lut_index % columns) * cell_width;
+        int32_t y = CellPadding + (lut_index / columns) * cell_height;
+
+        CopyToCell(sheet, x, y, thumbnail);
+        DrawLabel(sheet, x, y + proxy.Height + 3, proxy.Width, name.substr(0, name.find_last_of('.')));
+    });
+
+    std::string sheet_path = std::string(output_directory) + "/contact-sheet.png";
+
+    bool res = Image::SaveImage(sheet_path.c_str(), sheet);
+
+    return res && std::find(results.begin(), results.end(), false) == results.end();
+}
+
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Image.h"
+
+namespace ContactSheet
+{
+
+// Renders a thumbnail of the image under every entry of LUTs[] into
+// output_directory, along with a labelled contact-sheet.png grid of them all
+bool Render(const Image::ImageData& image, const Image::ProcessParams& process_params, const char* output_directory, int32_t thumbnail_size);
+
+}
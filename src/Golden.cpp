@@ -0,0 +1,435 @@
+#include "Golden.h"
+#include "Image.h"
+#include "FilmGrain.h"
+#include "LUTs.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#define ARRAYSIZE(_ARR) ((int)(sizeof(_ARR) / sizeof(*_ARR)))
+
+namespace Golden
+{
+
+static const int32_t PatternWidth = 48;
+static const int32_t PatternHeight = 32;
+static const int32_t TimingWidth = 1024;
+static const int32_t TimingHeight = 768;
+
+struct Pattern
+{
+    const char* Name;
+    int32_t Comp;
+    void (*Generate)(int32_t width, int32_t height, int32_t comp, uint8_t* pixels);
+};
+
+struct Profile
+{
+    const char* Name;
+    bool CPUPipeline;
+    float LUTStrength;
+    float GrainStrength;
+    float VignetteStrength;
+    float Hue;
+    float Saturation;
+    float Lightness;
+    float Brightness;
+    float Contrast;
+};
+
+static void GenerateRamp(int32_t width, int32_t height, int32_t comp, uint8_t* pixels)
+{
+    for (int32_t i = 0; i < height; ++i)
+    {
+        for (int32_t j = 0; j < width; ++j)
+        {
+            uint8_t* pixel = &pixels[(i * width + j) * comp];
+
+            pixel[0] = (uint8_t)(j * 255 / (width - 1));
+            pixel[1] = (uint8_t)(i * 255 / (height - 1));
+            pixel[2] = (uint8_t)(255 - (pixel[0] + pixel[1]) / 2);
+
+            // Alpha is replaced by the pipeline, it only has to be carried
+            if (comp == 4) pixel[3] = (uint8_t)(i * 255 / (height - 1));
+        }
+    }
+}
+
+// Every grey level, the diagonal of the cube where most LUTs are most visible
+static void GenerateGreys(int32_t width, int32_t height, int32_t comp, uint8_t* pixels)
+{
+    for (int32_t i = 0; i < width * height; ++i)
+    {
+        memset(&pixels[i * comp], i & 0xff, comp);
+    }
+}
+
+// Every grey level against an alpha ramp, for grey with alpha inputs
+static void GenerateGreyAlpha(int32_t width, int32_t height, int32_t comp, uint8_t* pixels)
+{
+    for (int32_t i = 0; i < height; ++i)
+    {
+        for (int32_t j = 0; j < width; ++j)
+        {
+            uint8_t* pixel = &pixels[(i * width + j) * comp];
+
+            pixel[0] = (uint8_t)((i * width + j) & 0xff);
+            pixel[1] = (uint8_t)(j * 255 / (width - 1));
+        }
+    }
+}
+
+// Uniform over the whole cube, so that every lattice cell gets sampled
+static void GenerateNoise(int32_t width, int32_t height, int32_t comp, uint8_t* pixels)
+{
+    uint32_t noise = 0x9e3779b9;
+
+    for (int32_t i = 0; i < width * height * comp; ++i)
+    {
+        noise = noise * 1664525u + 1013904223u;
+        pixels[i] = noise >> 24;
+    }
+}
+
+static const Pattern Patterns[] = {
+    { "ramp",      3, GenerateRamp },
+    { "greys",     3, GenerateGreys },
+    { "noise",     3, GenerateNoise },
+    { "alpha",     4, GenerateRamp },
+    { "grey",      1, GenerateGreys },
+    { "greyalpha", 2, GenerateGreyAlpha },
+};
+
+static const Profile Profiles[] = {
+    // name       cpu    lut   grain vign  hue   sat   light bright contrast
+    { "lut-only", false, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 1.0f },
+    { "neutral",  true,  1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 1.0f },
+    { "typical",  true,  0.8f, 0.3f, 0.5f, 0.95f, 0.9f, 1.0f, 0.02f, 1.05f },
+    { "strong",   true,  0.5f, 1.0f, 1.0f, 0.7f, 1.5f, 0.8f, -0.1f, 1.4f },
+};
+
+static Image::ProcessParams ProfileParams(const Profile& profile, int lut_index, Image::ProcessPrecision precision)
+{
+    Image::ProcessParams process_params;
+    process_params.LUTFile = LUTs[lut_index];
+    process_params.LUTIndex = lut_index;
+    process_params.GrainFile = FilmGrain[0];
+    process_params.CPUPipeline = profile.CPUPipeline;
+    process_params.LUTStrength = profile.LUTStrength;
+    process_params.GrainStrength = profile.GrainStrength;
+    process_params.VignetteStrength = profile.VignetteStrength;
+    process_params.Hue = profile.Hue;
+    process_params.Saturation = profile.Saturation;
+    process_params.Lightness = profile.Lightness;
+    process_params.Brightness = profile.Brightness;
+    process_params.Contrast = profile.Contrast;
+    process_params.Precision = precision;
+    return process_params;
+}
+
+// Stacks the outputs of every LUT vertically, one golden file per pattern and
+// profile rather than thousands of tiny ones
+static void RenderAtlas(const Image::ImageData& image, const Profile& profile, const std::vector<Image::LUTDesc>& luts, const Image::ImageData& grain, Image::ProcessPrecision precision, std::vector<uint8_t>& atlas)
+{
+    size_t tile_size = image.Width * image.Height * Image::OutputComp(image.Comp);
+
+    atlas.resize(tile_size * luts.size());
+
+    Parallel::For(luts.size(), [&](int lut_index)
+    {
+        Image::ImageDesc output;
+        output.Data = image;
+
+        Image::ProcessImage(output, ProfileParams(profile, lut_index, precision), luts[lut_index], grain);
+
+        std::copy(output.ScratchData, output.ScratchData + tile_size, atlas.begin() + tile_size * lut_index);
+    });
+}
+
+static void CompareTile(const uint8_t* pixels, const uint8_t* golden, size_t size, double& psnr, int& max_error)
+{
+    double squared_error = 0.0;
+
+    max_error = 0;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        int error = std::abs((int)pixels[i] - (int)golden[i]);
+
+        squared_error += error * error;
+        max_error = std::max(max_error, error);
+    }
+
+    double mse = squared_error / size;
+
+    psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+}
+
+// Median nanoseconds per pixel of the whole pipeline for a profile, over at
+// least five runs and 300 ms
+static double MeasureProfile(const Image::ImageData& image, const Profile& profile, const Image::LUTDesc& lut, const Image::ImageData& grain, Image::ProcessPrecision precision)
+{
+    using Clock = std::chrono::steady_clock;
+
+    Image::ProcessParams process_params = ProfileParams(profile, 0, precision);
+    std::vector<double> samples;
+    double total = 0.0;
+
+    while (samples.size() < 5 || total < 0.3)
+    {
+        Image::ImageDesc output;
+        output.Data = image;
+
+        auto start = Clock::now();
+        Image::ProcessImage(output, process_params, lut, grain);
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        samples.push_back(elapsed);
+        total += elapsed;
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    return samples[samples.size() / 2] / (image.Width * image.Height) * 1e9;
+}
+
+static bool LoadTimings(const std::string& path, std::map<std::string, double>& timings)
+{
+    std::ifstream file(path);
+
+    if (!file.is_open()) return false;
+
+    std::string name;
+    double ns_per_pixel;
+
+    while (file >> name >> ns_per_pixel)
+    {
+        timings[name] = ns_per_pixel;
+    }
+
+    return true;
+}
+
+static bool SaveTimings(const std::string& path, const std::map<std::string, double>& timings)
+{
+    FILE* file = fopen(path.c_str(), "w");
+
+    if (!file) return false;
+
+    for (const auto& timing : timings)
+    {
+        fprintf(file, "%s %.4f\n", timing.first.c_str(), timing.second);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+bool Run(const GoldenOptions& options)
+{
+    std::string directory(options.Directory);
+    std::vector<Image::LUTDesc> luts(ARRAYSIZE(LUTs));
+    std::vector<char> loaded(luts.size(), false);
+
+    Parallel::For(luts.size(), [&](int lut_index)
+    {
+        loaded[lut_index] = Image::LoadLUT(LUTs[lut_index], luts[lut_index]);
+    });
+
+    for (size_t i = 0; i < luts.size(); ++i)
+    {
+        if (!loaded[i])
+        {
+            fprintf(stderr, "Failed to load %s\n", LUTs[i]);
+            return false;
+        }
+    }
+
+    Image::ImageData grain;
+
+    if (!Image::LoadImage(FilmGrain[0], grain))
+    {
+        fprintf(stderr, "Failed to load %s\n", FilmGrain[0]);
+        return false;
+    }
+
+    if (options.Update) mkdir(directory.c_str(), 0755);
+
+    int failures = 0;
+
+    if (!options.Update)
+    {
+        printf("%-10s %-10s %10s %10s %8s\n", "pattern", "profile", "min PSNR", "max error", "failed");
+    }
+
+    for (const Pattern& pattern : Patterns)
+    {
+        std::vector<uint8_t> pixels(PatternWidth * PatternHeight * pattern.Comp);
+        pattern.Generate(PatternWidth, PatternHeight, pattern.Comp, pixels.data());
+
+        Image::ImageData image;
+        image.Pixels = pixels.data();
+        image.Width = PatternWidth;
+        image.Height = PatternHeight;
+        image.Comp = pattern.Comp;
+
+        // Grey patterns come out as RGB, or RGBA with their alpha
+        int32_t output_comp = Image::OutputComp(pattern.Comp);
+        size_t tile_size = PatternWidth * PatternHeight * output_comp;
+
+        for (const Profile& profile : Profiles)
+        {
+            std::vector<uint8_t> atlas;
+            RenderAtlas(image, profile, luts, grain, options.Precision, atlas);
+
+            std::string path = directory + "/" + pattern.Name + "-" + profile.Name + ".png";
+
+            Image::ImageDesc atlas_image;
+            atlas_image.Data.Width = PatternWidth;
+            atlas_image.Data.Height = PatternHeight * luts.size();
+            atlas_image.Data.Comp = output_comp;
+
+            if (options.Update)
+            {
+                atlas_image.ScratchData = new uint8_t[atlas.size()];
+                std::copy(atlas.begin(), atlas.end(), atlas_image.ScratchData);
+
+                if (!Image::SaveImage(path.c_str(), atlas_image))
+                {
+                    fprintf(stderr, "Failed to write %s\n", path.c_str());
+                    failures++;
+                }
+
+                printf("Wrote %s\n", path.c_str());
+                continue;
+            }
+
+            Image::ImageData golden;
+
+            if (!Image::LoadImage(path.c_str(), golden))
+            {
+                fprintf(stderr, "Missing golden %s, run with --golden-update first\n", path.c_str());
+                failures++;
+                continue;
+            }
+
+            if (golden.Width != atlas_image.Data.Width || golden.Height != atlas_image.Data.Height || golden.Comp != atlas_image.Data.Comp)
+            {
+                fprintf(stderr, "Golden %s has a different layout, regenerate it\n", path.c_str());
+                Image::FreeImage(golden);
+                failures++;
+                continue;
+            }
+
+            double min_psnr = INFINITY;
+            int max_error = 0;
+            int failed_tiles = 0;
+
+            for (size_t lut_index = 0; lut_index < luts.size(); ++lut_index)
+            {
+                double psnr;
+                int error;
+
+                CompareTile(&atlas[tile_size * lut_index], &golden.Pixels[tile_size * lut_index], tile_size, psnr, error);
+
+                min_psnr = std::min(min_psnr, psnr);
+                max_error = std::max(max_error, error);
+
+                if (psnr < options.MinPSNR || error > options.MaxError)
+                {
+                    fprintf(stderr, "%s/%s/%s: PSNR %.2f dB, max error %d\n", pattern.Name, profile.Name, LUTs[lut_index], psnr, error);
+                    failed_tiles++;
+                }
+            }
+
+            printf("%-10s %-10s %10.2f %10d %8d\n", pattern.Name, profile.Name, min_psnr, max_error, failed_tiles);
+
+            failures += failed_tiles;
+
+            Image::FreeImage(golden);
+        }
+    }
+
+    std::vector<uint8_t> timing_pixels(TimingWidth * TimingHeight * 3);
+    GenerateNoise(TimingWidth, TimingHeight, 3, timing_pixels.data());
+
+    Image::ImageData timing_image;
+    timing_image.Pixels = timing_pixels.data();
+    timing_image.Width = TimingWidth;
+    timing_image.Height = TimingHeight;
+    timing_image.Comp = 3;
+
+    std::string timings_path = options.Timings;
+    std::map<std::string, double> timings;
+
+    // Each precision keeps its own baseline, updating one leaves the others
+    bool has_timings = LoadTimings(timings_path, timings);
+    bool record_timings = options.Update;
+
+    if (!has_timings)
+    {
+        printf("\nNo timing baseline for this machine yet, recording %s\n", timings_path.c_str());
+    }
+
+    printf("\n%-18s %10s %10s %8s\n", "profile", "ns/px", "baseline", "change");
+
+    for (const Profile& profile : Profiles)
+    {
+        std::string name = profile.Name;
+
+        if (options.Precision != Image::ProcessPrecisionExact)
+        {
+            name += std::string("-") + Image::PrecisionName(options.Precision);
+        }
+
+        double ns_per_pixel = MeasureProfile(timing_image, profile, luts[0], grain, options.Precision);
+
+        auto base = timings.find(name);
+
+        if (options.Update || base == timings.end())
+        {
+            printf("%-18s %10.2f %10s %8s\n", name.c_str(), ns_per_pixel, "-", "-");
+            timings[name] = ns_per_pixel;
+            record_timings = true;
+            continue;
+        }
+
+        double change = (ns_per_pixel / base->second - 1.0) * 100.0;
+
+        printf("%-18s %10.2f %10.2f %+7.1f%%\n", name.c_str(), ns_per_pixel, base->second, change);
+
+        if (change > options.Margin)
+        {
+            fprintf(stderr, "%s is %.1f%% slower than the baseline, beyond the %d%% margin\n", name.c_str(), change, options.Margin);
+            failures++;
+        }
+    }
+
+    if (record_timings && !SaveTimings(timings_path, timings))
+    {
+        fprintf(stderr, "Failed to write %s\n", timings_path.c_str());
+        failures++;
+    }
+
+    Image::FreeImage(grain);
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d golden check(s) failed\n", failures);
+    }
+
+    return failures == 0;
+}
+
+}
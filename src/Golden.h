@@ -0,0 +1,29 @@
+#pragma once
+
+#include "Image.h"
+
+namespace Golden
+{
+
+struct GoldenOptions
+{
+    const char* Directory;
+    // Throughput baseline, kept per machine rather than with the outputs
+    const char* Timings;
+    bool Update;
+    int MinPSNR;
+    int MaxError;
+    int Margin;
+    Image::ProcessPrecision Precision;
+};
+
+// Renders a fixed set of synthetic patterns through every entry of LUTs[]
+// under several profiles. With Update, stores the results in Directory and
+// the per-profile throughput in Timings, otherwise compares against them and
+// fails when a LUT tile drops below MinPSNR dB or differs by more than
+// MaxError, or when throughput drops by more than Margin percent. A missing
+// throughput baseline is recorded rather than compared. Goldens are meant to
+// be written in the exact precision and checked in the others.
+bool Run(const GoldenOptions& options);
+
+}
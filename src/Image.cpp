@@ -1,12 +1,24 @@
 #include "Image.h"
+#include "ImageKernels.h"
+#include "Probes.h"
+#include "Trace.h"
 #include "Util.h"
 #include "FilmGrain.h"
 #include "LUTs.h"
+#include "Parallel.h"
 
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <vector>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -31,6 +43,34 @@ ImageData::ImageData()
     std::memset(this, 0x0, sizeof(ImageData));
 }
 
+LUTDesc::LUTDesc()
+    : Level(0)
+    , Size(0)
+    , Class(LUTClassGeneral)
+    , ClassError(0.0f)
+{
+}
+
+ProcessParams::ProcessParams()
+    : LUTFile(LUTs[0])
+    , LUTIndex(0)
+    , GrainFile(FilmGrain[0])
+    , GrainIndex(0)
+    , LUTStrength(1.0f)
+    , GrainStrength(0.0f)
+    , VignetteStrength(0.0f)
+    , Hue(1.0f)
+    , Saturation(1.0f)
+    , Lightness(1.0f)
+    , Brightness(0.0f)
+    , Contrast(1.0f)
+    , CPUPipeline(true)
+    , Filters(ProcessFilterLUT | ProcessFilterAll)
+    , Precision(ProcessPrecisionExact)
+    , Memoize(false)
+{
+}
+
 HistogramDesc::HistogramDesc(unsigned int width, unsigned int height)
     : MaxValue(0.0f)
     , Width(width)
@@ -107,262 +147,287 @@ void CaptureHistogram(HistogramDesc& histogram, unsigned int width, unsigned int
 }
 #endif
 
-float SRGB2Linear(float c)
+// Contents of an image or asset file
+static std::vector<char> ReadAsset(const char* path)
 {
-    if (c <= 0.04045f)
-    {
-        return c / 12.92f;
-    }
-    return powf((c + 0.055f) / 1.055f, 2.4f);
-}
+    auto data = Util::BytesFromFile(path);
 
-float Linear2SRGB(float c)
-{
-    if (c <= 0.0031308f)
+#ifdef DSIP_GUI
+    if (data.size() == 0)
     {
-        return 12.92f * c;
+        // Fallback to bundle
+        data = Util::BytesFromBundle(path);
     }
-    return powf(c, 1.0f / 2.4f) * 1.055f - 0.055f;
+#endif
+
+    return data;
 }
 
-float Clamp(float v, float min, float max)
+bool LoadImage(const char* path, ImageData& image)
 {
-    return v <= min ? min : v >= max ? max : v;
+    TRACE_SCOPE("LoadImage");
+    DSIP_PROBE1(load_image_entry, path);
+
+    auto image_data = ReadAsset(path);
+
+    bool res = image_data.size() > 0 && DecodeImage(image_data, image);
+
+    DSIP_PROBE4(load_image_return, path, res ? image.Width : 0, res ? image.Height : 0, res ? image.Comp : 0);
+
+    return res;
 }
 
-float Mix(float f0, float f1, float v)
+bool DecodeImage(const std::vector<char>& image_data, ImageData& image)
 {
-    return f0 * v + f1 * (1.0f - v);
+    TRACE_SCOPE("DecodeImage");
+
+    const stbi_uc* stbi_data = reinterpret_cast<const stbi_uc*>(image_data.data());
+
+    image.Pixels = stbi_load_from_memory(stbi_data, image_data.size(), &image.Width, &image.Height, &image.Comp, 0);
+
+    if (!image.Pixels) return false;
+
+    return true;
 }
 
-void HSV2RGB(const float* hsv, float* output)
+bool IsGreyscale(const ImageDesc& image)
 {
-    float hue = hsv[0];
-    float saturation = hsv[1];
-    float lightness = hsv[2];
+    int32_t comp = OutputComp(image.Data.Comp);
+    size_t pixel_count = (size_t)image.Data.Width * image.Data.Height;
+    const uint8_t* pixels = image.ScratchData;
 
-    if (saturation == 0.0f)
+    for (size_t i = 0; i < pixel_count; ++i, pixels += comp)
     {
-        output[0] = output[1] = output[2] = lightness;
-        return;
+        if (pixels[0] != pixels[1] || pixels[1] != pixels[2]) return false;
     }
 
-    float h = hue / 60.0f;
-    int i = (int)h;
-    float frac = h - i;
-    float p = lightness * (1.0f - saturation);
-    float q = lightness * (1.0f - saturation * frac);
-    float t = lightness * (1.0f - saturation * (1.0f - frac));
-
-    switch(i)
-    {
-        case 0:
-            output[0] = lightness;
-            output[1] = t;
-            output[2] = p;
-            break;
-        case 1:
-            output[0] = q;
-            output[1] = lightness;
-            output[2] = p;
-            break;
-        case 2:
-            output[0] = p;
-            output[1] = lightness;
-            output[2] = t;
-            break;
-        case 3:
-            output[0] = p;
-            output[1] = q;
-            output[2] = lightness;
-            break;
-        case 4:
-            output[0] = t;
-            output[1] = p;
-            output[2] = lightness;
-            break;
-        case 5:
-            output[0] = lightness;
-            output[1] = p;
-            output[2] = q;
-            break;
-        default:
-            assert(false);
-            break;
-    }
+    return true;
 }
 
-void RGB2HSV(const float* input, float* hsv)
+bool EncodeImage(const ImageDesc& image, std::vector<char>& image_data, bool allow_greyscale)
 {
-    float K = 0.0f;
-    float r = input[0];
-    float g = input[1];
-    float b = input[2];
+    TRACE_SCOPE("EncodeImage");
 
-    if (g < b)
-    {
-        std::swap(g, b);
-        K = -1.0f;
-    }
-    if (r < g)
-    {
-        std::swap(r, g);
-        K = -2.0f / 6.0f - K;
-    }
-    float chroma = r - std::min(g, b);
-    float hue = 360.0f * (K + (g - b) / (6.0f * chroma + 1e-20f));
-    if (hue < 0)
+    int length = 0;
+    int comp = OutputComp(image.Data.Comp);
+    uint8_t* pixels = image.ScratchData;
+    std::vector<uint8_t> grey_pixels;
+
+    // Keep the first colour channel and the alpha one, a third of the data for
+    // stb to filter and deflate
+    if (allow_greyscale && IsGreyscale(image))
     {
-        hue = -hue;
+        size_t pixel_count = (size_t)image.Data.Width * image.Data.Height;
+        int grey_comp = comp - 2;
+
+        grey_pixels.resize(pixel_count * grey_comp);
+
+        for (size_t i = 0; i < pixel_count; ++i)
+        {
+            grey_pixels[i * grey_comp] = pixels[i * comp];
+
+            if (grey_comp == 2) grey_pixels[i * 2 + 1] = pixels[i * comp + 3];
+        }
+
+        comp = grey_comp;
+        pixels = grey_pixels.data();
     }
-    float saturation = (chroma / (r + std::numeric_limits<float>::epsilon()));
-    float lightness = r;
 
-    hsv[0] = hue;
-    hsv[1] = saturation;
-    hsv[2] = lightness;
-}
+    int stride = image.Data.Width * comp;
+    unsigned char* png = stbi_write_png_to_mem(pixels, stride, image.Data.Width, image.Data.Height, comp, &length);
 
-void ApplyVignette(const float* input, float* output, float* uv)
-{
-    uv[0] *= 1.0 - uv[0];
-    uv[1] *= 1.0 - uv[1];
+    if (!png) return false;
+
+    image_data.assign(png, png + length);
 
-    float vignette = pow(uv[0] * uv[1] * 15.0f, 0.15);
+    STBIW_FREE(png);
 
-    // TODO: dither (only on CPU pipeline)
-    output[0] = input[0] * vignette;
-    output[1] = input[1] * vignette;
-    output[2] = input[2] * vignette;
+    return true;
 }
 
-void ApplyGrain(const float* input, float* output, float* grain)
+bool SaveImage(const char* path, const ImageDesc& image, bool allow_greyscale)
 {
-    auto BlendOverlay = [](float base, float blend) -> float
+    TRACE_SCOPE("SaveImage");
+    DSIP_PROBE4(save_image_entry, path, image.Data.Width, image.Data.Height, OutputComp(image.Data.Comp));
+
+    std::vector<char> image_data;
+    bool res = EncodeImage(image, image_data, allow_greyscale);
+
+    if (res)
     {
-        float strength = base > 0.5 ? 0.0 : 1.0;
-        return (1.0 - 2.0 * (1.0 - base) * (1.0 - blend)) * (1.0f - strength) + 2.0 * base * blend * strength;
-    };
+        TRACE_SCOPE("WriteFile");
+        res = Util::BytesToFile(path, image_data);
+    }
 
-    output[0] = BlendOverlay(input[0], grain[0]);
-    output[1] = BlendOverlay(input[1], grain[1]);
-    output[2] = BlendOverlay(input[2], grain[2]);
+    DSIP_PROBE2(save_image_return, path, res);
 
-#if 0
-    float grain_strength = 0.25;
-    out_rgb[0] = out_rgb[0] * (1.0f - grain_strength) + grain_r * grain_strength;
-    out_rgb[1] = out_rgb[1] * (1.0f - grain_strength) + grain_g * grain_strength;
-    out_rgb[2] = out_rgb[2] * (1.0f - grain_strength) + grain_b * grain_strength;
-#endif
+    return res;
 }
 
-void ApplyLUT(const float* input, float* output, float* clut, unsigned int level)
+struct ResizeSpan
 {
-    int color, red, green, blue, i, j;
-    float tmp[6], r, g, b;
-    level *= level;
+    int32_t First;
+    int32_t Count;
+    int32_t Weights;
+};
+
+// Box filter footprint of each output sample over the input axis, the weights
+// are the covered fraction of every input sample and sum to one
+void ComputeResizeSpans(int32_t size, int32_t output_size, std::vector<ResizeSpan>& spans, std::vector<float>& weights)
+{
+    float scale = (float)size / output_size;
 
-    red = input[0] * (float)(level - 1);
-    if(red > level - 2)
-        red = (float)level - 2;
-    if(red < 0)
-        red = 0;
+    spans.resize(output_size);
+    weights.clear();
 
-    green = input[1] * (float)(level - 1);
-    if(green > level - 2)
-        green = (float)level - 2;
-    if(green < 0)
-        green = 0;
+    for (int32_t i = 0; i < output_size; ++i)
+    {
+        float start = i * scale;
+        float end = std::min((i + 1) * scale, (float)size);
 
-    blue = input[2] * (float)(level - 1);
-    if(blue > level - 2)
-        blue = (float)level - 2;
-    if(blue < 0)
-        blue = 0;
+        ResizeSpan& span = spans[i];
+        span.First = (int32_t)start;
+        span.Count = std::min((int32_t)std::ceil(end), size) - span.First;
+        span.Weights = weights.size();
 
-    r = input[0] * (float)(level - 1) - red;
-    g = input[1] * (float)(level - 1) - green;
-    b = input[2] * (float)(level - 1) - blue;
+        for (int32_t j = span.First; j < span.First + span.Count; ++j)
+        {
+            float coverage = std::min(end, j + 1.0f) - std::max(start, (float)j);
+            weights.push_back(coverage / scale);
+        }
+    }
+}
 
-    color = red + green * level + blue * level * level;
+void ResizePixels(const uint8_t* pixels, int32_t width, int32_t height, int32_t comp, uint8_t* output, int32_t output_width, int32_t output_height)
+{
+    std::vector<ResizeSpan> row_spans, column_spans;
+    std::vector<float> row_weights, column_weights;
 
-    i = color * 3;
-    j = (color + 1) * 3;
+    ComputeResizeSpans(height, output_height, row_spans, row_weights);
+    ComputeResizeSpans(width, output_width, column_spans, column_weights);
 
-    tmp[0] = clut[i++] * (1 - r) + clut[j++] * r;
-    tmp[1] = clut[i++] * (1 - r) + clut[j++] * r;
-    tmp[2] = clut[i] * (1 - r) + clut[j] * r;
+    int32_t row_size = width * comp;
+    std::vector<float> row(row_size);
 
-    i = (color + level) * 3;
-    j = (color + level + 1) * 3;
+    for (int32_t i = 0; i < output_height; ++i)
+    {
+        const ResizeSpan& row_span = row_spans[i];
 
-    tmp[3] = clut[i++] * (1 - r) + clut[j++] * r;
-    tmp[4] = clut[i++] * (1 - r) + clut[j++] * r;
-    tmp[5] = clut[i] * (1 - r) + clut[j] * r;
+        // Vertical pass, contiguous multiply-adds over a whole input row so the
+        // compiler vectorizes them for the target (SSE/AVX or NEON)
+        std::fill(row.begin(), row.end(), 0.0f);
 
-    output[0] = tmp[0] * (1 - g) + tmp[3] * g;
-    output[1] = tmp[1] * (1 - g) + tmp[4] * g;
-    output[2] = tmp[2] * (1 - g) + tmp[5] * g;
+        for (int32_t j = 0; j < row_span.Count; ++j)
+        {
+            const uint8_t* input = pixels + (row_span.First + j) * row_size;
+            float weight = row_weights[row_span.Weights + j];
 
-    i = (color + level * level) * 3;
-    j = (color + level * level + 1) * 3;
+            for (int32_t k = 0; k < row_size; ++k)
+            {
+                row[k] += input[k] * weight;
+            }
+        }
 
-    tmp[0] = clut[i++] * (1 - r) + clut[j++] * r;
-    tmp[1] = clut[i++] * (1 - r) + clut[j++] * r;
-    tmp[2] = clut[i] * (1 - r) + clut[j] * r;
+        // Horizontal pass over the accumulated row
+        uint8_t* output_row = output + i * output_width * comp;
 
-    i = (color + level + level * level) * 3;
-    j = (color + level + level * level + 1) * 3;
+        for (int32_t j = 0; j < output_width; ++j)
+        {
+            const ResizeSpan& column_span = column_spans[j];
+            float pixel[4] = {0.0f};
 
-    tmp[3] = clut[i++] * (1 - r) + clut[j++] * r;
-    tmp[4] = clut[i++] * (1 - r) + clut[j++] * r;
-    tmp[5] = clut[i] * (1 - r) + clut[j] * r;
+            for (int32_t k = 0; k < column_span.Count; ++k)
+            {
+                const float* input = &row[(column_span.First + k) * comp];
+                float weight = column_weights[column_span.Weights + k];
 
-    tmp[0] = tmp[0] * (1 - g) + tmp[3] * g;
-    tmp[1] = tmp[1] * (1 - g) + tmp[4] * g;
-    tmp[2] = tmp[2] * (1 - g) + tmp[5] * g;
+                for (int32_t c = 0; c < comp; ++c)
+                {
+                    pixel[c] += input[c] * weight;
+                }
+            }
 
-    output[0] = output[0] * (1 - b) + tmp[0] * b;
-    output[1] = output[1] * (1 - b) + tmp[1] * b;
-    output[2] = output[2] * (1 - b) + tmp[2] * b;
+            for (int32_t c = 0; c < comp; ++c)
+            {
+                output_row[j * comp + c] = (uint8_t)Clamp(pixel[c] + 0.5f, 0.0f, 255.0f);
+            }
+        }
+    }
 }
 
-bool LoadImage(const char* path, ImageData& image)
+void FitSize(int32_t width, int32_t height, int32_t max_size, int32_t& fit_width, int32_t& fit_height)
 {
-    auto image_data = Util::BytesFromFile(path);
+    float ratio = std::min(1.0f, (float)max_size / std::max(width, height));
 
-#ifdef DSIP_GUI
-    if (image_data.size() == 0)
-    {
-        // Fallback to bundle
-        image_data = Util::BytesFromBundle(path);
-    }
-#endif
+    fit_width = std::max(1, (int32_t)std::lround(width * ratio));
+    fit_height = std::max(1, (int32_t)std::lround(height * ratio));
+}
 
-    if (image_data.size() == 0) return false;
+void DownscaleImage(const ImageDesc& image, ImageDesc& rendition, int32_t max_size)
+{
+    TRACE_SCOPE("DownscaleImage");
 
-    const stbi_uc* stbi_data = reinterpret_cast<const stbi_uc*>(image_data.data());
+    FitSize(image.Data.Width, image.Data.Height, max_size, rendition.Data.Width, rendition.Data.Height);
 
-    image.Pixels = stbi_load_from_memory(stbi_data, image_data.size(), &image.Width, &image.Height, &image.Comp, 0);
+    rendition.Data.Comp = OutputComp(image.Data.Comp);
 
-    if (!image.Pixels) return false;
+    delete[] rendition.ScratchData;
+    rendition.ScratchData = new uint8_t[rendition.Data.Width * rendition.Data.Height * rendition.Data.Comp];
+    rendition.ScratchSize = 0;
 
-    return true;
+    ResizePixels(image.ScratchData, image.Data.Width, image.Data.Height, rendition.Data.Comp,
+        rendition.ScratchData, rendition.Data.Width, rendition.Data.Height);
+}
+
+void FreeImage(const ImageData& image_data)
+{
+    if (image_data.Pixels)
+    {
+        stbi_image_free(image_data.Pixels);
+    }
 }
 
-bool SaveImage(const char* path, const ImageDesc& image)
+std::string SerializeProfile(const ProcessParams& process_params)
 {
-    stbi_write_png(path, image.Data.Width, image.Data.Height, image.Data.Comp, image.ScratchData, 0);
+    std::ostringstream profile;
+
+    profile << "lut_file_index:" << process_params.LUTIndex << std::endl;
+    profile << "lut_strength:" << process_params.LUTStrength << std::endl;
+    profile << "grain_strength:" << process_params.GrainStrength << std::endl;
+    profile << "vignette_strength:" << process_params.VignetteStrength << std::endl;
+    profile << "hue:" << process_params.Hue << std::endl;
+    profile << "saturation:" << process_params.Saturation << std::endl;
+    profile << "lightness:" << process_params.Lightness << std::endl;
+    profile << "brightness:" << process_params.Brightness << std::endl;
+    profile << "contrast:" << process_params.Contrast << std::endl;
+
+    for (const ChainedLUT& chained : process_params.LUTChain)
+    {
+        profile << "lut_chain:" << chained.LUTIndex << ":" << chained.Strength << std::endl;
+    }
 
-    return true;
+    return profile.str();
 }
 
-void FreeImage(const ImageData& image_data)
+static const char* PrecisionNames[] = { "exact", "balanced", "fast", "fixed" };
+
+bool ParsePrecision(const char* name, ProcessPrecision& precision)
 {
-    if (image_data.Pixels)
+    for (int i = 0; i < (int)(sizeof(PrecisionNames) / sizeof(*PrecisionNames)); ++i)
     {
-        stbi_image_free(image_data.Pixels);
+        if (strcmp(name, PrecisionNames[i]) == 0)
+        {
+            precision = (ProcessPrecision)i;
+            return true;
+        }
     }
+
+    return false;
+}
+
+const char* PrecisionName(ProcessPrecision precision)
+{
+    return PrecisionNames[precision];
 }
 
 bool SaveProfile(const char* path, const ProcessParams& process_params)
@@ -371,15 +436,7 @@ bool SaveProfile(const char* path, const ProcessParams& process_params)
 
     if (!file_profile.is_open()) return false;
 
-    file_profile << "lut_file_index:" << process_params.LUTIndex << std::endl;
-    file_profile << "lut_strength:" << process_params.LUTStrength << std::endl;
-    file_profile << "grain_strength:" << process_params.GrainStrength << std::endl;
-    file_profile << "vignette_strength:" << process_params.VignetteStrength << std::endl;
-    file_profile << "hue:" << process_params.Hue << std::endl;
-    file_profile << "saturation:" << process_params.Saturation << std::endl;
-    file_profile << "lightness:" << process_params.Lightness << std::endl;
-    file_profile << "brightness:" << process_params.Brightness << std::endl;
-    file_profile << "contrast:" << process_params.Contrast << std::endl;
+    file_profile << SerializeProfile(process_params);
 
     file_profile.close();
 
@@ -415,20 +472,173 @@ bool LoadProfile(const char* path, ProcessParams& process_params)
     ReadParam("brightness", &process_params.Brightness);
     ReadParam("contrast", &process_params.Contrast);
 
+    // Optional looks applied after the first one, one line each
+    process_params.LUTChain.clear();
+
+    while (std::getline(file_profile, line, eol))
+    {
+        ChainedLUT chained;
+
+        if (std::sscanf(line.c_str(), "lut_chain:%d:%f", &chained.LUTIndex, &chained.Strength) != 2) continue;
+
+        if (chained.LUTIndex < 0 || chained.LUTIndex >= (int)(sizeof(LUTs) / sizeof(*LUTs)))
+        {
+            fprintf(stderr, "Invalid chained LUT index %d in %s\n", chained.LUTIndex, path);
+            return false;
+        }
+
+        process_params.LUTChain.push_back(chained);
+    }
+
     file_profile.close();
 
     return true;
 }
 
-void ProcessImage(ImageDesc& image, ProcessParams process_params)
+int GrainIndexFromSeed(uint32_t seed)
 {
-    ImageData lut_image;
-    ImageData grain_image;
+    // Integer hash finalizer, nearby seeds land on unrelated grain frames
+    seed ^= seed >> 16;
+    seed *= 0x7feb352d;
+    seed ^= seed >> 15;
+    seed *= 0x846ca68b;
+    seed ^= seed >> 16;
+
+    return seed % (sizeof(FilmGrain) / sizeof(*FilmGrain));
+}
+
+int GrainIndexForFrame(uint32_t seed, int frame)
+{
+    int count = sizeof(FilmGrain) / sizeof(*FilmGrain);
+
+    return ((GrainIndexFromSeed(seed) + frame) % count + count) % count;
+}
+
+// Lattice sizes tried by ResampleLUT, smallest first
+static const uint32_t LUTResampleSizes[] = { 9, 17, 25, 33, 49 };
+
+static float s_LUTErrorBudget = 0.0f;
+
+void SetLUTErrorBudget(float max_delta_e)
+{
+    s_LUTErrorBudget = max_delta_e;
+}
+
+void SRGBToLab(const float* rgb, float* lab)
+{
+    float linear[3] = { SRGB2Linear(rgb[0]), SRGB2Linear(rgb[1]), SRGB2Linear(rgb[2]) };
+
+    float xyz[3] = {
+        (0.4124f * linear[0] + 0.3576f * linear[1] + 0.1805f * linear[2]) / 0.95047f,
+        (0.2126f * linear[0] + 0.7152f * linear[1] + 0.0722f * linear[2]),
+        (0.0193f * linear[0] + 0.1192f * linear[1] + 0.9505f * linear[2]) / 1.08883f,
+    };
 
-    LoadImage(process_params.LUTFile, lut_image);
-    LoadImage(process_params.GrainFile, grain_image);
+    for (float& v : xyz)
+    {
+        v = v > 216.0f / 24389.0f ? std::cbrt(v) : (24389.0f / 27.0f * v + 16.0f) / 116.0f;
+    }
+
+    lab[0] = 116.0f * xyz[1] - 16.0f;
+    lab[1] = 500.0f * (xyz[0] - xyz[1]);
+    lab[2] = 200.0f * (xyz[1] - xyz[2]);
+}
+
+void SampleLUT(const LUTDesc& lut, uint32_t size, LUTDesc& sampled)
+{
+    float scale = 1.0f / (size - 1);
+
+    sampled.Cube.resize(size * size * size * 3);
+    sampled.Lattice.resize(sampled.Cube.size());
+    sampled.Level = lut.Level;
+    sampled.Size = size;
+
+    for (uint32_t b = 0, index = 0; b < size; ++b)
+    {
+        for (uint32_t g = 0; g < size; ++g)
+        {
+            for (uint32_t r = 0; r < size; ++r, index += 3)
+            {
+                float rgb[3] = { r * scale, g * scale, b * scale };
+
+                ApplyLUT(rgb, &sampled.Cube[index], lut.Cube.data(), lut.Size);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < sampled.Cube.size(); ++i)
+    {
+        sampled.Lattice[i] = (uint8_t)lroundf(sampled.Cube[i] * 255.0f);
+    }
+
+    ClassifyLUT(sampled);
+}
+
+bool ResampleLUT(LUTDesc& lut, float max_delta_e)
+{
+    TRACE_SCOPE("ResampleLUT");
+
+    uint32_t size = lut.Size;
+    float scale = 1.0f / (size - 1);
+
+    // The loaded lattice points are where the smaller lattices are checked
+    std::vector<float> reference(lut.Cube.size());
+
+    for (size_t i = 0; i < lut.Cube.size(); i += 3)
+    {
+        SRGBToLab(&lut.Cube[i], &reference[i]);
+    }
+
+    for (uint32_t resample_size : LUTResampleSizes)
+    {
+        if (resample_size >= size) break;
+
+        LUTDesc resampled;
+        SampleLUT(lut, resample_size, resampled);
+
+        // The loaded lattices are 8-bit, so a few points differ by more than
+        // their rounding in any smaller lattice. Allow 1% of them over budget
+        uint32_t over_budget = 0;
+        uint32_t max_over_budget = size * size * size / 100;
+
+        for (uint32_t b = 0, index = 0; b < size && over_budget <= max_over_budget; ++b)
+        {
+            for (uint32_t g = 0; g < size; ++g)
+            {
+                for (uint32_t r = 0; r < size; ++r, index += 3)
+                {
+                    float rgb[3] = { r * scale, g * scale, b * scale };
+                    float output[3], lab[3];
+
+                    ApplyLUT(rgb, output, resampled.Cube.data(), resample_size);
+                    SRGBToLab(output, lab);
+
+                    float dl = lab[0] - reference[index + 0];
+                    float da = lab[1] - reference[index + 1];
+                    float db = lab[2] - reference[index + 2];
+
+                    if (dl * dl + da * da + db * db > max_delta_e * max_delta_e) ++over_budget;
+                }
+            }
+        }
+
+        if (over_budget > max_over_budget) continue;
 
-    float* lut = new float[lut_image.Width * lut_image.Height * lut_image.Comp];
+        lut = std::move(resampled);
+
+        return true;
+    }
+
+    return false;
+}
+
+// Lattice of a decoded Hald CLUT image, which it frees
+static void FillLUT(ImageData& lut_image, LUTDesc& lut)
+{
+    lut.Cube.resize(lut_image.Width * lut_image.Height * 3);
+    lut.Lattice.resize(lut.Cube.size());
+    lut.Level = std::lround(std::cbrt(lut_image.Width));
+    lut.Size = lut.Level * lut.Level;
 
     for (int i = 0, lut_index = 0; i < lut_image.Height; ++i)
     {
@@ -436,110 +646,1029 @@ void ProcessImage(ImageDesc& image, ProcessParams process_params)
         {
             int pixel_index = i * lut_image.Comp * lut_image.Width + j * lut_image.Comp;
 
-            lut[lut_index++] = lut_image.Pixels[pixel_index + 0] / 255.0f;
-            lut[lut_index++] = lut_image.Pixels[pixel_index + 1] / 255.0f;
-            lut[lut_index++] = lut_image.Pixels[pixel_index + 2] / 255.0f;
+            for (int c = 0; c < 3; ++c, ++lut_index)
+            {
+                lut.Lattice[lut_index] = lut_image.Pixels[pixel_index + c];
+                lut.Cube[lut_index] = lut_image.Pixels[pixel_index + c] / 255.0f;
+            }
         }
     }
 
-    image.ScratchData = new uint8_t[image.Data.Width * image.Data.Height * image.Data.Comp];
+    FreeImage(lut_image);
 
-    uint32_t film_grain_size = grain_image.Width * grain_image.Height * grain_image.Comp;
+    ClassifyLUT(lut);
 
-    for (int i = 0; i < image.Data.Height; ++i)
+    if (s_LUTErrorBudget > 0.0f)
     {
-        for (int j = 0; j < image.Data.Width; ++j)
-        {
-            int pixel_index = i * image.Data.Width * image.Data.Comp + j * image.Data.Comp;
+        ResampleLUT(lut, s_LUTErrorBudget);
+    }
+}
 
-            int i0 = pixel_index + 0;
-            int i1 = pixel_index + 1;
-            int i2 = pixel_index + 2;
+bool LoadLUT(const char* path, LUTDesc& lut)
+{
+    TRACE_SCOPE("LoadLUT");
 
-            float rgb1[3], rgb0[3] = {
-                image.Data.Pixels[i0] / 255.0f,
-                image.Data.Pixels[i1] / 255.0f,
-                image.Data.Pixels[i2] / 255.0f,
-            };
+    ImageData lut_image;
 
-            ApplyLUT(rgb0, rgb1, lut, pow(lut_image.Width, 1.0f / 3.0f));
+    if (!LoadImage(path, lut_image)) return false;
 
-            if (process_params.CPUPipeline)
-            {
-                float hsv[3];
+    FillLUT(lut_image, lut);
+
+    return true;
+}
+
+bool DecodeLUT(const std::vector<char>& lut_data, LUTDesc& lut)
+{
+    TRACE_SCOPE("LoadLUT");
+
+    ImageData lut_image;
+
+    if (!DecodeImage(lut_data, lut_image)) return false;
 
-                rgb0[0] = SRGB2Linear(rgb0[0]);
-                rgb0[1] = SRGB2Linear(rgb0[1]);
-                rgb0[2] = SRGB2Linear(rgb0[2]);
+    FillLUT(lut_image, lut);
 
-                RGB2HSV(rgb0, hsv);
+    return true;
+}
+
+bool SaveLUT(const char* path, const LUTDesc& lut)
+{
+    int32_t width = lut.Level * lut.Level * lut.Level;
 
-                hsv[0] *= process_params.Hue;
-                hsv[1] *= process_params.Saturation;
-                hsv[2] *= process_params.Lightness;
+    if (lut.Size != lut.Level * lut.Level || lut.Lattice.size() != (size_t)width * width * 3)
+    {
+        fprintf(stderr, "LUT lattice of %u points is not a Hald level, not saving %s\n", lut.Size, path);
+        return false;
+    }
 
-                HSV2RGB(hsv, rgb0);
+    // The Hald image rows hold the lattice in its own order
+    ImageDesc image;
+    image.Data.Width = width;
+    image.Data.Height = width;
+    image.Data.Comp = 3;
+    image.ScratchData = new uint8_t[lut.Lattice.size()];
 
-                rgb1[0] = Mix(SRGB2Linear(rgb1[0]), rgb0[0], process_params.LUTStrength);
-                rgb1[1] = Mix(SRGB2Linear(rgb1[1]), rgb0[1], process_params.LUTStrength);
-                rgb1[2] = Mix(SRGB2Linear(rgb1[2]), rgb0[2], process_params.LUTStrength);
+    std::copy(lut.Lattice.begin(), lut.Lattice.end(), image.ScratchData);
 
-                float cb_bias = (0.5f - process_params.Contrast * 0.5f) + process_params.Brightness;
+    return SaveImage(path, image);
+}
 
-                rgb1[0] = rgb1[0] * process_params.Contrast + cb_bias;
-                rgb1[1] = rgb1[1] * process_params.Contrast + cb_bias;
-                rgb1[2] = rgb1[2] * process_params.Contrast + cb_bias;
+void ComposeLUT(LUTDesc& lut, const LUTDesc& next, float strength)
+{
+    TRACE_SCOPE("ComposeLUT");
 
-                int grain_pixel_index = i * grain_image.Width * grain_image.Comp + j * grain_image.Comp;
-                float grain[3] = {
-                    grain_image.Pixels[(grain_pixel_index + 0) % film_grain_size] / 255.0f,
-                    grain_image.Pixels[(grain_pixel_index + 1) % film_grain_size] / 255.0f,
-                    grain_image.Pixels[(grain_pixel_index + 2) % film_grain_size] / 255.0f,
-                };
+    for (size_t i = 0; i < lut.Cube.size(); i += 3)
+    {
+        float* rgb = &lut.Cube[i];
+        float output[3];
 
-                ApplyGrain(rgb1, rgb0, grain);
+        ApplyLUT(rgb, output, next.Cube.data(), next.Size);
 
-                rgb0[0] = Mix(rgb0[0], rgb1[0], process_params.GrainStrength);
-                rgb0[1] = Mix(rgb0[1], rgb1[1], process_params.GrainStrength);
-                rgb0[2] = Mix(rgb0[2], rgb1[2], process_params.GrainStrength);
+        for (int c = 0; c < 3; ++c)
+        {
+            float linear = Mix(SRGB2Linear(output[c]), SRGB2Linear(rgb[c]), strength);
 
-                float half_pixel_width = 0.5f / image.Data.Width;
-                float half_pixel_height = 0.5f / image.Data.Height;
+            rgb[c] = Clamp(Linear2SRGB(linear), 0.0f, 1.0f);
+            lut.Lattice[i + c] = (uint8_t)lroundf(rgb[c] * 255.0f);
+        }
+    }
 
-                float texture_coordinates[2] {
-                    i / float(image.Data.Height) + half_pixel_height,
-                    j / float(image.Data.Width) + half_pixel_width,
-                };
+    ClassifyLUT(lut);
+}
 
-                ApplyVignette(rgb0, rgb1, texture_coordinates);
+// Largest lattice difference in 8-bit steps for a LUT to be given a class
+static const float LUTClassTolerance = 1.0f;
 
-                rgb1[0] = Mix(rgb1[0], rgb0[0], process_params.VignetteStrength);
-                rgb1[1] = Mix(rgb1[1], rgb0[1], process_params.VignetteStrength);
-                rgb1[2] = Mix(rgb1[2], rgb0[2], process_params.VignetteStrength);
+static const char* LUTClassNames[] = { "general", "identity", "separable", "monochrome" };
 
-                image.ScratchData[i0] = (uint8_t)(Clamp(Linear2SRGB(rgb1[0]), 0.0f, 1.0f) * 255.0f);
-                image.ScratchData[i1] = (uint8_t)(Clamp(Linear2SRGB(rgb1[1]), 0.0f, 1.0f) * 255.0f);
-                image.ScratchData[i2] = (uint8_t)(Clamp(Linear2SRGB(rgb1[2]), 0.0f, 1.0f) * 255.0f);
-            }
-            else
+const char* LUTClassName(LUTClass lut_class)
+{
+    return LUTClassNames[lut_class];
+}
+
+void ClassifyLUT(LUTDesc& lut)
+{
+    int size = lut.Size;
+    const float* cube = lut.Cube.data();
+
+    lut.Class = LUTClassGeneral;
+    lut.ClassError = 0.0f;
+    lut.Curves.clear();
+    lut.Grey.clear();
+
+    // Candidate curves, each channel averaged over the two other axes
+    std::vector<double> sums(3 * size, 0.0);
+
+    for (int b = 0, index = 0; b < size; ++b)
+    {
+        for (int g = 0; g < size; ++g)
+        {
+            for (int r = 0; r < size; ++r, index += 3)
             {
-                image.ScratchData[i0] = (uint8_t)(rgb1[0] * 255.0f);
-                image.ScratchData[i1] = (uint8_t)(rgb1[1] * 255.0f);
-                image.ScratchData[i2] = (uint8_t)(rgb1[2] * 255.0f);
+                sums[r] += cube[index + 0];
+                sums[size + g] += cube[index + 1];
+                sums[2 * size + b] += cube[index + 2];
             }
+        }
+    }
+
+    std::vector<float> curves(3 * size);
+
+    for (int k = 0; k < 3 * size; ++k)
+    {
+        curves[k] = (float)(sums[k] / ((double)size * size));
+    }
 
-            if (image.Data.Comp == 4)
+    float identity_error = 0.0f;
+    float separable_error = 0.0f;
+    float grey_error = 0.0f;
+
+    for (int b = 0, index = 0; b < size; ++b)
+    {
+        for (int g = 0; g < size; ++g)
+        {
+            for (int r = 0; r < size; ++r, index += 3)
             {
-                int i3 = i * image.Data.Width * image.Data.Comp + j * image.Data.Comp + 3;
-                image.ScratchData[i3] = 255;
+                const float* rgb = &cube[index];
+                int axes[3] = { r, g, b };
+
+                for (int c = 0; c < 3; ++c)
+                {
+                    identity_error = std::max(identity_error, std::fabs(rgb[c] - (float)axes[c] / (size - 1)));
+                    separable_error = std::max(separable_error, std::fabs(rgb[c] - curves[c * size + axes[c]]));
+                }
+
+                grey_error = std::max(grey_error, std::max(std::fabs(rgb[0] - rgb[1]), std::fabs(rgb[1] - rgb[2])));
             }
         }
     }
 
-    FreeImage(lut_image);
-    FreeImage(grain_image);
+    if (identity_error * 255.0f <= LUTClassTolerance)
+    {
+        lut.Class = LUTClassIdentity;
+        lut.ClassError = identity_error * 255.0f;
+    }
+    else if (separable_error * 255.0f <= LUTClassTolerance)
+    {
+        lut.Class = LUTClassSeparable;
+        lut.ClassError = separable_error * 255.0f;
+        lut.Curves.swap(curves);
+    }
+    else if (grey_error * 255.0f <= LUTClassTolerance)
+    {
+        lut.Class = LUTClassMonochrome;
+        lut.ClassError = grey_error * 255.0f;
+        lut.Grey.resize(size * size * size);
+
+        for (size_t i = 0; i < lut.Grey.size(); ++i)
+        {
+            lut.Grey[i] = (float)(((double)cube[i * 3] + cube[i * 3 + 1] + cube[i * 3 + 2]) / 3.0);
+        }
+    }
+}
+
+// Class kernel that may replace ApplyLUT for a precision. The class kernels
+// approximate trilinear sampling within LUTClassTolerance, except the
+// monochrome one on a lattice with equal channels which matches it, so that
+// is all the exact and fixed precisions take.
+static LUTClass DispatchLUTClass(const LUTDesc& lut, ProcessPrecision precision)
+{
+    if (precision == ProcessPrecisionBalanced || precision == ProcessPrecisionFast) return lut.Class;
+
+    return lut.Class == LUTClassMonochrome && lut.ClassError == 0.0f ? LUTClassMonochrome : LUTClassGeneral;
+}
+
+uint64_t DecodedSize(const LUTDesc& lut)
+{
+    return (lut.Cube.size() + lut.Curves.size() + lut.Grey.size()) * sizeof(float) + lut.Lattice.size();
+}
+
+uint64_t DecodedSize(const ImageData& image)
+{
+    return (uint64_t)image.Width * image.Height * image.Comp;
+}
+
+// Keeps the most recently acquired assets decoded, so that switching looks or
+// processing several images does not decode the same PNGs again. Entries are
+// keyed by the hash of the file contents and remember every path found with
+// those bytes, byte-identical assets under different names share one entry.
+template <typename T>
+class AssetCache
+{
+public:
+    AssetCache(size_t capacity) : m_Capacity(capacity), m_Stats() {}
+
+    template <typename Decoder>
+    std::shared_ptr<const T> Acquire(const char* path, Decoder decoder)
+    {
+        if (!path) return nullptr;
+
+        if (auto asset = Find(path)) return asset;
+
+        std::vector<char> data = ReadAsset(path);
+
+        if (data.empty()) return nullptr;
+
+        uint64_t hash = Util::Hash(data.data(), data.size());
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+
+            if (auto asset = Share(hash, path)) return asset;
+        }
+
+        std::shared_ptr<T> asset = decoder(data);
+
+        if (!asset) return nullptr;
+
+        return Insert(hash, path, asset);
+    }
+
+    // Assets built from other ones rather than read from a file, keyed by a
+    // name describing how they were built
+    template <typename Builder>
+    std::shared_ptr<const T> AcquireBuilt(const std::string& name, Builder builder)
+    {
+        if (auto asset = Find(name)) return asset;
+
+        std::shared_ptr<T> asset = builder();
+
+        if (!asset) return nullptr;
+
+        return Insert(Util::Hash(name.data(), name.size()), name, asset);
+    }
+
+    // Hash of the contents of path, as an entry already found at path keys
+    // it or read from the file otherwise, 0 when it cannot be read
+    uint64_t ContentHash(const char* path)
+    {
+        if (!path) return 0;
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+
+            for (const Entry& entry : m_Entries)
+            {
+                if (std::find(entry.Paths.begin(), entry.Paths.end(), path) != entry.Paths.end()) return entry.Hash;
+            }
+        }
+
+        std::vector<char> data = ReadAsset(path);
+
+        return data.empty() ? 0 : Util::Hash(data.data(), data.size());
+    }
+
+    AssetStats Stats()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_Stats;
+    }
+
+    void SetCapacity(size_t capacity)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        m_Capacity = capacity;
+
+        while (m_Entries.size() > m_Capacity)
+        {
+            m_Entries.pop_back();
+        }
+    }
+
+private:
+    std::shared_ptr<const T> Find(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        for (auto it = m_Entries.begin(); it != m_Entries.end(); ++it)
+        {
+            if (std::find(it->Paths.begin(), it->Paths.end(), path) != it->Paths.end())
+            {
+                m_Entries.splice(m_Entries.begin(), m_Entries, it);
+                return it->Asset;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Entry with the contents of hash, which path is added to, m_Mutex held
+    std::shared_ptr<const T> Share(uint64_t hash, const std::string& path)
+    {
+        for (auto it = m_Entries.begin(); it != m_Entries.end(); ++it)
+        {
+            if (it->Hash != hash) continue;
+
+            m_Entries.splice(m_Entries.begin(), m_Entries, it);
+
+            if (std::find(it->Paths.begin(), it->Paths.end(), path) == it->Paths.end())
+            {
+                it->Paths.push_back(path);
+                m_Stats.Shared++;
+                m_Stats.SavedBytes += DecodedSize(*it->Asset);
+            }
+
+            return it->Asset;
+        }
+
+        return nullptr;
+    }
+
+    std::shared_ptr<const T> Insert(uint64_t hash, const std::string& path, std::shared_ptr<const T> asset)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        // Another caller missing on the same contents may have decoded them
+        // meanwhile, its copy is kept and this one dropped
+        if (auto shared = Share(hash, path)) return shared;
+
+        m_Entries.push_front({ hash, { path }, asset });
+        m_Stats.Decoded++;
+
+        if (m_Entries.size() > m_Capacity)
+        {
+            m_Entries.pop_back();
+        }
+
+        return asset;
+    }
+
+    struct Entry
+    {
+        uint64_t Hash;
+        std::vector<std::string> Paths;
+        std::shared_ptr<const T> Asset;
+    };
+
+    size_t m_Capacity;
+    std::mutex m_Mutex;
+    std::list<Entry> m_Entries;
+    AssetStats m_Stats;
+};
+
+static AssetCache<LUTDesc> s_LUTCache(16);
+static AssetCache<ImageData> s_GrainCache(8);
+
+std::shared_ptr<const LUTDesc> AcquireLUT(const char* path)
+{
+    DSIP_PROBE1(lut_acquire_entry, path);
+
+    auto lut = s_LUTCache.Acquire(path, [](const std::vector<char>& lut_data)
+    {
+        auto lut = std::make_shared<LUTDesc>();
+        return DecodeLUT(lut_data, *lut) ? lut : nullptr;
+    });
+
+    DSIP_PROBE2(lut_acquire_return, path, lut ? lut->Size : 0);
+
+    return lut;
+}
+
+std::shared_ptr<const LUTDesc> AcquireLUT(const ProcessParams& process_params)
+{
+    if (process_params.LUTChain.empty()) return AcquireLUT(process_params.LUTFile);
+
+    std::ostringstream name;
+    name << process_params.LUTFile;
+
+    for (const ChainedLUT& chained : process_params.LUTChain)
+    {
+        name << "+" << LUTs[chained.LUTIndex] << "@" << chained.Strength;
+    }
+
+    return s_LUTCache.AcquireBuilt(name.str(), [&]() -> std::shared_ptr<LUTDesc>
+    {
+        auto first = AcquireLUT(process_params.LUTFile);
+
+        if (!first) return nullptr;
+
+        auto lut = std::make_shared<LUTDesc>(*first);
+
+        for (const ChainedLUT& chained : process_params.LUTChain)
+        {
+            auto next = AcquireLUT(LUTs[chained.LUTIndex]);
+
+            if (!next) return nullptr;
+
+            ComposeLUT(*lut, *next, chained.Strength);
+        }
+
+        return lut;
+    });
+}
+
+std::shared_ptr<const ImageData> AcquireGrain(const char* path)
+{
+    DSIP_PROBE1(grain_acquire_entry, path);
+
+    auto grain = s_GrainCache.Acquire(path, [](const std::vector<char>& grain_data)
+    {
+        std::shared_ptr<ImageData> grain(new ImageData(), [](ImageData* grain_image)
+        {
+            FreeImage(*grain_image);
+            delete grain_image;
+        });
+        return DecodeImage(grain_data, *grain) ? grain : nullptr;
+    });
+
+    DSIP_PROBE4(grain_acquire_return, path, grain ? grain->Width : 0, grain ? grain->Height : 0, grain ? grain->Comp : 0);
+
+    return grain;
+}
+
+void SetGrainCacheCapacity(size_t frames)
+{
+    s_GrainCache.SetCapacity(frames);
+}
+
+uint64_t LUTContentHash(const char* path)
+{
+    return s_LUTCache.ContentHash(path);
+}
+
+uint64_t GrainContentHash(const char* path)
+{
+    return s_GrainCache.ContentHash(path);
+}
+
+void GetAssetStats(AssetStats& luts, AssetStats& grains)
+{
+    luts = s_LUTCache.Stats();
+    grains = s_GrainCache.Stats();
+}
+
+bool ProcessImage(ImageDesc& image, ProcessParams process_params)
+{
+    TRACE_SCOPE("ProcessImage");
+
+    auto lut = AcquireLUT(process_params);
+    auto grain = AcquireGrain(process_params.GrainFile);
+
+    if (!lut || !grain) return false;
+
+    ProcessImage(image, process_params, *lut, *grain);
+
+    return true;
+}
+
+static std::atomic<uint64_t> s_ColourCacheLookups(0);
+static std::atomic<uint64_t> s_ColourCacheHits(0);
+
+// Open addressing map from packed RGB24 colours to the output of the colour
+// stages, for screenshots and flat artwork with few distinct colours. Once
+// full it only serves lookups, and it turns itself off when a window of
+// lookups hits less often than is worth the probing.
+class ColourCache
+{
+public:
+    ColourCache(bool enabled)
+        : m_Entries(0)
+        , m_Lookups(0)
+        , m_Hits(0)
+        , m_WindowHits(0)
+        , m_Enabled(enabled)
+    {
+        if (m_Enabled)
+        {
+            m_Keys.assign(Capacity, 0);
+            m_Values.resize(Capacity * 3);
+        }
+    }
+
+    ~ColourCache()
+    {
+        s_ColourCacheLookups += m_Lookups;
+        s_ColourCacheHits += m_Hits;
+    }
+
+    bool Lookup(uint32_t colour, float* rgb)
+    {
+        if (!m_Enabled) return false;
+
+        m_Lookups++;
+
+        if (m_Lookups % WindowSize == 0)
+        {
+            m_Enabled = m_WindowHits * 100 >= WindowSize * MinHitPercent;
+            m_WindowHits = 0;
+        }
+
+        uint32_t key = colour | OccupiedBit;
+
+        for (uint32_t slot = Slot(colour); m_Keys[slot] != 0; slot = (slot + 1) & (Capacity - 1))
+        {
+            if (m_Keys[slot] == key)
+            {
+                rgb[0] = m_Values[slot * 3 + 0];
+                rgb[1] = m_Values[slot * 3 + 1];
+                rgb[2] = m_Values[slot * 3 + 2];
+                m_Hits++;
+                m_WindowHits++;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Insert(uint32_t colour, const float* rgb)
+    {
+        if (!m_Enabled || m_Entries >= Capacity / 2) return;
+
+        uint32_t slot = Slot(colour);
+
+        while (m_Keys[slot] != 0)
+        {
+            slot = (slot + 1) & (Capacity - 1);
+        }
+
+        m_Keys[slot] = colour | OccupiedBit;
+        m_Values[slot * 3 + 0] = rgb[0];
+        m_Values[slot * 3 + 1] = rgb[1];
+        m_Values[slot * 3 + 2] = rgb[2];
+        m_Entries++;
+    }
+
+private:
+    static const uint32_t Capacity = 1 << 14;
+    static const uint32_t OccupiedBit = 1 << 24;
+    static const uint32_t WindowSize = 1 << 14;
+    static const uint32_t MinHitPercent = 30;
+
+    static uint32_t Slot(uint32_t colour)
+    {
+        return (colour * 0x9e3779b1u) >> (32 - 14);
+    }
+
+    std::vector<uint32_t> m_Keys;
+    std::vector<float> m_Values;
+    uint32_t m_Entries;
+    uint64_t m_Lookups;
+    uint64_t m_Hits;
+    uint64_t m_WindowHits;
+    bool m_Enabled;
+};
+
+void ColourCacheStats(uint64_t& lookups, uint64_t& hits)
+{
+    lookups = s_ColourCacheLookups;
+    hits = s_ColourCacheHits;
+}
+
+// Pixels per ProcessImage tile. Large images split into bands of rows that idle
+// workers steal, thumbnails stay a single task
+static const int32_t TilePixels = 1 << 18;
+
+// Runs process_rows over the tiles of an image across the workers
+static void ForEachTile(int32_t width, int32_t height, const std::function<void(int32_t row_begin, int32_t row_end)>& process_rows)
+{
+    int32_t tile_rows = std::max(1, TilePixels / std::max(width, 1));
+    int tile_count = (height + tile_rows - 1) / tile_rows;
+
+    Parallel::For(tile_count, [&](int tile)
+    {
+        int32_t row_begin = tile * tile_rows;
+        process_rows(row_begin, std::min(row_begin + tile_rows, height));
+    });
+}
+
+// Integer version of the pixel loop below, run stage by stage over a row at a
+// time so that the arithmetic stages vectorize
+static void ProcessPixelsFixed(ImageDesc& image, const ProcessParams& process_params, const LUTDesc& lut, const ImageData& grain_image)
+{
+    const FixedTables& tables = GetFixedTables();
+
+    int32_t width = image.Data.Width;
+    int32_t height = image.Data.Height;
+    int32_t comp = image.Data.Comp;
+    int32_t row_size = width * 3;
+    int lut_size = lut.Size;
+    uint32_t film_grain_size = grain_image.Width * grain_image.Height * grain_image.Comp;
+
+    int filters = process_params.Filters;
+
+    float contrast = (filters & ProcessFilterContrast) ? process_params.Contrast : 1.0f;
+    float brightness = (filters & ProcessFilterBrightness) ? process_params.Brightness : 0.0f;
+
+    int32_t contrast_weight = ToWeight(contrast);
+    int32_t cb_bias = (int32_t)lroundf(((0.5f - contrast * 0.5f) + brightness) * FixedOne);
+    int32_t lut_strength = ToWeight(process_params.LUTStrength);
+    int32_t grain_strength = ToWeight(process_params.GrainStrength);
+    int32_t vignette_strength = ToWeight(process_params.VignetteStrength);
+    int32_t hue = (int32_t)lroundf(process_params.Hue * FixedOne);
+    int32_t saturation = (int32_t)lroundf(process_params.Saturation * FixedOne);
+    int32_t lightness = (int32_t)lroundf(process_params.Lightness * FixedOne);
+
+    // The float round trip through HSV is an identity when nothing is scaled
+    bool adjust_hsv = (filters & ProcessFilterHSV) && (hue != FixedOne || saturation != FixedOne || lightness != FixedOne);
+
+    int32_t lattice_cells[256];
+    int32_t lattice_weights[256];
+    ComputeLatticeAxis(lut_size, lattice_cells, lattice_weights);
+
+    int lut_channels = DispatchLUTClass(lut, ProcessPrecisionFixed) == LUTClassMonochrome ? 1 : 3;
+
+    std::vector<float> vignette_rows, vignette_columns;
+    std::vector<int32_t> column_gains(width);
+
+    if (filters & ProcessFilterVignette)
+    {
+        ComputeVignetteFactors(height, 15.0f, vignette_rows);
+        ComputeVignetteFactors(width, 1.0f, vignette_columns);
+
+        for (int32_t j = 0; j < width; ++j)
+        {
+            column_gains[j] = ToWeight(vignette_columns[j]);
+        }
+    }
+
+    int32_t output_comp = OutputComp(comp);
+    int32_t pixel_comp = std::max(comp, 3);
+
+    ForEachTile(width, height, [&](int32_t row_begin, int32_t row_end)
+    {
+        std::vector<uint32_t> lut_rgb(row_size);
+        std::vector<int32_t> source(row_size);
+        std::vector<int32_t> linear(row_size);
+        std::vector<int32_t> blend(row_size);
+        std::vector<int32_t> gains(width);
+        std::vector<uint8_t> grey_rgb(comp < 3 ? row_size : 0);
+
+        for (int32_t i = row_begin; i < row_end; ++i)
+        {
+            const uint8_t* row = image.Data.Pixels + i * width * comp;
+            const uint8_t* pixels = row;
+            uint8_t* output = image.ScratchData + i * width * output_comp;
+
+            // Grey rows are expanded to RGB once, the kernels below read three channels
+            if (comp < 3)
+            {
+                for (int32_t j = 0; j < width; ++j)
+                {
+                    grey_rgb[j * 3 + 0] = grey_rgb[j * 3 + 1] = grey_rgb[j * 3 + 2] = row[j * comp];
+                }
+
+                pixels = grey_rgb.data();
+            }
+
+            if (filters & ProcessFilterLUT)
+            {
+                for (int32_t j = 0; j < width; ++j)
+                {
+                    ApplyLUTFixed(&pixels[j * pixel_comp], &lut_rgb[j * 3], lut.Lattice.data(), lattice_cells, lattice_weights, lut_size, lut_channels);
+                }
+            }
+
+            if (!process_params.CPUPipeline)
+            {
+                for (int32_t j = 0; j < width; ++j)
+                {
+                    for (int32_t c = 0; c < 3; ++c)
+                    {
+                        output[j * output_comp + c] = (filters & ProcessFilterLUT)
+                            ? (uint8_t)(lut_rgb[j * 3 + c] >> WeightShift)
+                            : (uint8_t)(pixels[j * pixel_comp + c] / 255.0f * 255.0f);
+                    }
+                }
+            }
+            else
+            {
+                for (int32_t j = 0; j < width; ++j)
+                {
+                    for (int32_t c = 0; c < 3; ++c)
+                    {
+                        source[j * 3 + c] = tables.ToLinear8[pixels[j * pixel_comp + c]];
+                    }
+                }
+
+                if (filters & ProcessFilterLUT)
+                {
+                    for (int32_t k = 0; k < row_size; ++k)
+                    {
+                        linear[k] = ToLinearFixed(LatticeToFixed(lut_rgb[k]), tables);
+                    }
+                }
+                else
+                {
+                    std::copy(source.begin(), source.end(), linear.begin());
+                }
+
+                if (adjust_hsv)
+                {
+                    for (int32_t j = 0; j < width; ++j)
+                    {
+                        AdjustHSVFixed(&source[j * 3], hue, saturation, lightness);
+                    }
+                }
+
+                for (int32_t k = 0; k < row_size; ++k)
+                {
+                    linear[k] = source[k] + MulWeight(linear[k] - source[k], lut_strength);
+                }
+
+                if (filters & (ProcessFilterBrightness | ProcessFilterContrast))
+                {
+                    for (int32_t k = 0; k < row_size; ++k)
+                    {
+                        int32_t value = MulWeight(linear[k], contrast_weight) + cb_bias;
+                        linear[k] = std::max(-FixedLimit, std::min(value, FixedLimit));
+                    }
+                }
+
+                if (filters & ProcessFilterGrain)
+                {
+                    uint32_t grain_row = i * grain_image.Width * grain_image.Comp;
+
+                    for (int32_t j = 0; j < width; ++j)
+                    {
+                        for (int32_t c = 0; c < 3; ++c)
+                        {
+                            blend[j * 3 + c] = tables.Weight8[grain_image.Pixels[(grain_row + j * grain_image.Comp + c) % film_grain_size]];
+                        }
+                    }
+
+                    for (int32_t k = 0; k < row_size; ++k)
+                    {
+                        int32_t overlay = BlendOverlayFixed(linear[k], blend[k]);
+                        linear[k] += MulWeight(overlay - linear[k], grain_strength);
+                    }
+                }
+
+                if (filters & ProcessFilterVignette)
+                {
+                    int32_t row_gain = ToWeight(vignette_rows[i]);
+
+                    for (int32_t j = 0; j < width; ++j)
+                    {
+                        int32_t vignette = MulWeight(row_gain, column_gains[j]);
+                        gains[j] = WeightOne + MulWeight(vignette - WeightOne, vignette_strength);
+                    }
+
+                    for (int32_t j = 0; j < width; ++j)
+                    {
+                        linear[j * 3 + 0] = MulWeight(linear[j * 3 + 0], gains[j]);
+                        linear[j * 3 + 1] = MulWeight(linear[j * 3 + 1], gains[j]);
+                        linear[j * 3 + 2] = MulWeight(linear[j * 3 + 2], gains[j]);
+                    }
+                }
+
+                for (int32_t j = 0; j < width; ++j)
+                {
+                    for (int32_t c = 0; c < 3; ++c)
+                    {
+                        output[j * output_comp + c] = tables.ToSRGB8[std::max(0, std::min(linear[j * 3 + c], FixedOne))];
+                    }
+                }
+            }
+
+            if (output_comp == 4)
+            {
+                for (int32_t j = 0; j < width; ++j)
+                {
+                    output[j * 4 + 3] = comp == 2 ? row[j * 2 + 1] : 255;
+                }
+            }
+        }
+    });
+}
+
+void ProcessImage(ImageDesc& image, const ProcessParams& process_params, const LUTDesc& lut, const ImageData& grain_image)
+{
+    TRACE_SCOPE("PixelLoop");
+    DSIP_PROBE4(process_image_entry, image.Data.Width, image.Data.Height, image.Data.Comp, process_params.LUTIndex);
+
+    size_t scratch_size = (size_t)image.Data.Width * image.Data.Height * OutputComp(image.Data.Comp);
+
+    if (!image.ScratchData || image.ScratchSize < scratch_size)
+    {
+        delete[] image.ScratchData;
+        image.ScratchData = new uint8_t[scratch_size];
+        image.ScratchSize = scratch_size;
+    }
+
+    if (process_params.Precision == ProcessPrecisionFixed)
+    {
+        ProcessPixelsFixed(image, process_params, lut, grain_image);
+
+        DSIP_PROBE4(process_image_return, image.Data.Width, image.Data.Height, image.Data.Comp, process_params.LUTIndex);
+        return;
+    }
+
+    uint32_t film_grain_size = grain_image.Width * grain_image.Height * grain_image.Comp;
+
+    int filters = process_params.Filters;
+
+    float contrast = (filters & ProcessFilterContrast) ? process_params.Contrast : 1.0f;
+    float brightness = (filters & ProcessFilterBrightness) ? process_params.Brightness : 0.0f;
+    float cb_bias = (0.5f - contrast * 0.5f) + brightness;
+
+    ProcessPrecision precision = process_params.Precision;
+    const TransferTables& transfer = GetTransferTables();
+    LUTClass lut_class = DispatchLUTClass(lut, precision);
+
+    std::vector<float> vignette_rows, vignette_columns;
+
+    if ((filters & ProcessFilterVignette) && precision != ProcessPrecisionExact)
+    {
+        ComputeVignetteFactors(image.Data.Height, 15.0f, vignette_rows);
+        ComputeVignetteFactors(image.Data.Width, 1.0f, vignette_columns);
+    }
+
+    // LUT, linearisation, HSV, strength mix, brightness and contrast, the
+    // stages that depend on the input colour alone
+    auto process_colour = [&](const uint8_t* input, float* rgb1)
+    {
+        float rgb0[3];
+
+        rgb0[0] = input[0] / 255.0f;
+        rgb0[1] = input[1] / 255.0f;
+        rgb0[2] = input[2] / 255.0f;
+
+        if ((filters & ProcessFilterLUT) && lut_class == LUTClassSeparable)
+        {
+            ApplyLUTSeparable(rgb0, rgb1, lut.Curves.data(), lut.Size);
+        }
+        else if ((filters & ProcessFilterLUT) && lut_class == LUTClassMonochrome)
+        {
+            ApplyLUTMonochrome(rgb0, rgb1, lut.Grey.data(), lut.Size);
+        }
+        else if ((filters & ProcessFilterLUT) && lut_class == LUTClassGeneral && precision != ProcessPrecisionFast)
+        {
+            ApplyLUT(rgb0, rgb1, lut.Cube.data(), lut.Size);
+        }
+        else if ((filters & ProcessFilterLUT) && lut_class == LUTClassGeneral)
+        {
+            ApplyLUTTetrahedral(rgb0, rgb1, lut.Cube.data(), lut.Size);
+        }
+        else
+        {
+            // No LUT stage, or an identity one
+            rgb1[0] = rgb0[0];
+            rgb1[1] = rgb0[1];
+            rgb1[2] = rgb0[2];
+        }
+
+        if (!process_params.CPUPipeline) return;
+
+        float hsv[3];
+
+        rgb0[0] = transfer.ToLinear8[input[0]];
+        rgb0[1] = transfer.ToLinear8[input[1]];
+        rgb0[2] = transfer.ToLinear8[input[2]];
+
+        if (filters & ProcessFilterHSV)
+        {
+            RGB2HSV(rgb0, hsv);
+
+            hsv[0] *= process_params.Hue;
+            hsv[1] *= process_params.Saturation;
+            hsv[2] *= process_params.Lightness;
+
+            HSV2RGB(hsv, rgb0);
+        }
+
+        rgb1[0] = Mix(ToLinear(rgb1[0], precision, transfer), rgb0[0], process_params.LUTStrength);
+        rgb1[1] = Mix(ToLinear(rgb1[1], precision, transfer), rgb0[1], process_params.LUTStrength);
+        rgb1[2] = Mix(ToLinear(rgb1[2], precision, transfer), rgb0[2], process_params.LUTStrength);
+
+        if (filters & (ProcessFilterBrightness | ProcessFilterContrast))
+        {
+            rgb1[0] = rgb1[0] * contrast + cb_bias;
+            rgb1[1] = rgb1[1] * contrast + cb_bias;
+            rgb1[2] = rgb1[2] * contrast + cb_bias;
+        }
+    };
+
+    int32_t comp = image.Data.Comp;
+    int32_t output_comp = OutputComp(comp);
+
+    // Grey inputs only have 256 colours, the colour stages run once for each
+    // along the grey diagonal and the pixels read one byte instead of three
+    std::vector<float> grey_colours;
+
+    if (comp < 3)
+    {
+        grey_colours.resize(256 * 3);
+
+        for (int v = 0; v < 256; ++v)
+        {
+            uint8_t grey[3] = { (uint8_t)v, (uint8_t)v, (uint8_t)v };
+            process_colour(grey, &grey_colours[v * 3]);
+        }
+    }
+
+    ForEachTile(image.Data.Width, image.Data.Height, [&](int32_t row_begin, int32_t row_end)
+    {
+        ColourCache colour_cache(process_params.Memoize && comp >= 3);
+
+        for (int i = row_begin; i < row_end; ++i)
+        {
+            for (int j = 0; j < image.Data.Width; ++j)
+            {
+                int pixel_index = (i * image.Data.Width + j) * comp;
+                int output_index = (i * image.Data.Width + j) * output_comp;
+
+                int i0 = output_index + 0;
+                int i1 = output_index + 1;
+                int i2 = output_index + 2;
+
+                const uint8_t* input = &image.Data.Pixels[pixel_index];
+                float rgb0[3], rgb1[3];
+
+                if (comp < 3)
+                {
+                    const float* grey_colour = &grey_colours[input[0] * 3];
+
+                    rgb1[0] = grey_colour[0];
+                    rgb1[1] = grey_colour[1];
+                    rgb1[2] = grey_colour[2];
+                }
+                else
+                {
+                    uint32_t colour = input[0] | input[1] << 8 | input[2] << 16;
+
+                    if (!colour_cache.Lookup(colour, rgb1))
+                    {
+                        process_colour(input, rgb1);
+                        colour_cache.Insert(colour, rgb1);
+                    }
+                }
+
+                if (process_params.CPUPipeline)
+                {
+                    if (filters & ProcessFilterGrain)
+                    {
+                        int grain_pixel_index = i * grain_image.Width * grain_image.Comp + j * grain_image.Comp;
+                        float grain[3] = {
+                            grain_image.Pixels[(grain_pixel_index + 0) % film_grain_size] / 255.0f,
+                            grain_image.Pixels[(grain_pixel_index + 1) % film_grain_size] / 255.0f,
+                            grain_image.Pixels[(grain_pixel_index + 2) % film_grain_size] / 255.0f,
+                        };
+
+                        ApplyGrain(rgb1, rgb0, grain);
+
+                        rgb0[0] = Mix(rgb0[0], rgb1[0], process_params.GrainStrength);
+                        rgb0[1] = Mix(rgb0[1], rgb1[1], process_params.GrainStrength);
+                        rgb0[2] = Mix(rgb0[2], rgb1[2], process_params.GrainStrength);
+                    }
+                    else
+                    {
+                        rgb0[0] = rgb1[0];
+                        rgb0[1] = rgb1[1];
+                        rgb0[2] = rgb1[2];
+                    }
+
+                    if ((filters & ProcessFilterVignette) && precision != ProcessPrecisionExact)
+                    {
+                        float vignette = vignette_rows[i] * vignette_columns[j];
+
+                        rgb1[0] = Mix(rgb0[0] * vignette, rgb0[0], process_params.VignetteStrength);
+                        rgb1[1] = Mix(rgb0[1] * vignette, rgb0[1], process_params.VignetteStrength);
+                        rgb1[2] = Mix(rgb0[2] * vignette, rgb0[2], process_params.VignetteStrength);
+                    }
+                    else if (filters & ProcessFilterVignette)
+                    {
+                        float half_pixel_width = 0.5f / image.Data.Width;
+                        float half_pixel_height = 0.5f / image.Data.Height;
+
+                        float texture_coordinates[2] {
+                            i / float(image.Data.Height) + half_pixel_height,
+                            j / float(image.Data.Width) + half_pixel_width,
+                        };
+
+                        ApplyVignette(rgb0, rgb1, texture_coordinates);
+
+                        rgb1[0] = Mix(rgb1[0], rgb0[0], process_params.VignetteStrength);
+                        rgb1[1] = Mix(rgb1[1], rgb0[1], process_params.VignetteStrength);
+                        rgb1[2] = Mix(rgb1[2], rgb0[2], process_params.VignetteStrength);
+                    }
+                    else
+                    {
+                        rgb1[0] = rgb0[0];
+                        rgb1[1] = rgb0[1];
+                        rgb1[2] = rgb0[2];
+                    }
+
+                    image.ScratchData[i0] = ToSRGB8(rgb1[0], precision, transfer);
+                    image.ScratchData[i1] = ToSRGB8(rgb1[1], precision, transfer);
+                    image.ScratchData[i2] = ToSRGB8(rgb1[2], precision, transfer);
+                }
+                else
+                {
+                    image.ScratchData[i0] = (uint8_t)(rgb1[0] * 255.0f);
+                    image.ScratchData[i1] = (uint8_t)(rgb1[1] * 255.0f);
+                    image.ScratchData[i2] = (uint8_t)(rgb1[2] * 255.0f);
+                }
+
+                if (output_comp == 4)
+                {
+                    image.ScratchData[output_index + 3] = comp == 2 ? input[1] : 255;
+                }
+            }
+        }
+    });
 
-    delete[] lut;
+    DSIP_PROBE4(process_image_return, image.Data.Width, image.Data.Height, image.Data.Comp, process_params.LUTIndex);
 }
 
 }
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "glad/glad.h"
 
@@ -20,14 +22,52 @@ struct ImageDesc
 {
     ImageDesc();
     ~ImageDesc();
+    // ScratchData is owned, copies would free it twice
+    ImageDesc(const ImageDesc&) = delete;
+    ImageDesc& operator=(const ImageDesc&) = delete;
     std::string Path;
+    // Processed pixels, with OutputComp(Data.Comp) channels
     uint8_t* ScratchData;
+    // Bytes allocated for ScratchData by ProcessImage, which reuses the buffer
+    // for later images that fit in it
+    size_t ScratchSize;
     GLuint Texture;
     GLuint TextureReference;
     GLuint TextureGrain;
     ImageData Data;
 };
 
+// Shape of a LUT found when loading it. Identity leaves colours unchanged,
+// separable is three independent per channel curves and monochrome maps every
+// colour to a grey. Anything else is general and needs the full lattice.
+enum LUTClass
+{
+    LUTClassGeneral,
+    LUTClassIdentity,
+    LUTClassSeparable,
+    LUTClassMonochrome,
+};
+
+struct LUTDesc
+{
+    LUTDesc();
+    // Hald CLUT lattice, RGB floats with red varying fastest
+    std::vector<float> Cube;
+    // The same lattice as loaded, 8-bit, for the fixed point kernels
+    std::vector<uint8_t> Lattice;
+    // Hald level of the loaded image
+    uint32_t Level;
+    // Lattice points per axis, Level * Level unless resampled to an error budget
+    uint32_t Size;
+    LUTClass Class;
+    // Largest difference between the lattice and its class, in 8-bit steps
+    float ClassError;
+    // Separable LUTs, one curve of Size entries per channel
+    std::vector<float> Curves;
+    // Monochrome LUTs, the grey lattice with one float per entry
+    std::vector<float> Grey;
+};
+
 struct HistogramDesc
 {
     HistogramDesc(unsigned int width, unsigned int height);
@@ -56,8 +96,31 @@ enum ProcessFilter
     ProcessFilterAll        = ~ProcessFilterLUT,
 };
 
+// Accuracy against speed of the CPU pipeline kernels. Exact evaluates the sRGB
+// transfer and vignette with pow, balanced uses interpolated transfer tables
+// and a separable vignette, fast replaces the interpolated tables with nearest
+// lookups and samples LUTs tetrahedrally rather than trilinearly. Fixed runs
+// the whole pipeline in integer arithmetic from the 8-bit input to the 8-bit
+// output.
+enum ProcessPrecision
+{
+    ProcessPrecisionExact,
+    ProcessPrecisionBalanced,
+    ProcessPrecisionFast,
+    ProcessPrecisionFixed,
+};
+
+// A look applied after the profile's LUT, mixed over the previous result in
+// linear light by its strength
+struct ChainedLUT
+{
+    int LUTIndex;
+    float Strength;
+};
+
 struct ProcessParams
 {
+    ProcessParams();
     const char* LUTFile;
     int LUTIndex;
     const char* GrainFile;
@@ -71,17 +134,56 @@ struct ProcessParams
     float Brightness;
     float Contrast;
     bool CPUPipeline;
+    // ProcessFilter mask of the CPU pipeline stages to run, all by default
+    int Filters;
+    ProcessPrecision Precision;
+    // Reuse the colour stages results for repeated input colours, the float
+    // precisions only
+    bool Memoize;
+    // Looks stacked after LUTFile, composed with it into a single lattice when
+    // acquired so that the pixel loop still does one lookup
+    std::vector<ChainedLUT> LUTChain;
 };
 
 bool LoadProfile(const char* path, ProcessParams& process_params);
 
 bool SaveProfile(const char* path, const ProcessParams& process_params);
 
+std::string SerializeProfile(const ProcessParams& process_params);
+
+bool ParsePrecision(const char* name, ProcessPrecision& precision);
+
+const char* PrecisionName(ProcessPrecision precision);
+
+// Channels of the processed pixels for comp input channels, grey inputs are
+// processed to RGB and grey with alpha to RGBA
+inline int32_t OutputComp(int32_t comp)
+{
+    return comp < 3 ? comp + 2 : comp;
+}
+
 bool LoadImage(const char* path, ImageData& image);
 
+bool DecodeImage(const std::vector<char>& image_data, ImageData& image);
+
 void FreeImage(const ImageData& image_data);
 
-bool SaveImage(const char* path, const ImageDesc& image);
+// With allow_greyscale, images whose pixels all have equal colour channels are
+// written as greyscale PNGs, with their alpha channel if any
+bool SaveImage(const char* path, const ImageDesc& image, bool allow_greyscale = false);
+
+bool EncodeImage(const ImageDesc& image, std::vector<char>& image_data, bool allow_greyscale = false);
+
+// True when every processed pixel has equal red, green and blue
+bool IsGreyscale(const ImageDesc& image);
+
+void FitSize(int32_t width, int32_t height, int32_t max_size, int32_t& fit_width, int32_t& fit_height);
+
+// Area filtered resize of 8-bit pixels to an equal or smaller size
+void ResizePixels(const uint8_t* pixels, int32_t width, int32_t height, int32_t comp, uint8_t* output, int32_t output_width, int32_t output_height);
+
+// Area filtered copy of the processed image fitting max_size on its longest edge
+void DownscaleImage(const ImageDesc& image, ImageDesc& rendition, int32_t max_size);
 
 #ifdef DSIP_GUI
 
@@ -89,6 +191,87 @@ void CaptureHistogram(HistogramDesc& histogram, unsigned int width, unsigned int
 
 #endif
 
-void ProcessImage(ImageDesc& image, ProcessParams process_params);
+// Deterministic pick of a FilmGrain[] frame
+int GrainIndexFromSeed(uint32_t seed);
+
+// FilmGrain[] frame of a sequence frame, the grain frames play in order from
+// the one the seed picks so that the grain animates
+int GrainIndexForFrame(uint32_t seed, int frame);
+
+bool LoadLUT(const char* path, LUTDesc& lut);
+
+bool DecodeLUT(const std::vector<char>& lut_data, LUTDesc& lut);
+
+// Writes a lattice of Level * Level points per axis as a Hald CLUT image
+bool SaveLUT(const char* path, const LUTDesc& lut);
+
+// CIE L*a*b* of an sRGB colour under D65
+void SRGBToLab(const float* rgb, float* lab);
+
+// CIE76 difference allowed for 99% of the lattice points when LUTs are loaded
+// onto a smaller lattice, 0 keeps the lattice of the file. Set before loading, LUTs already in the
+// asset cache keep their lattice
+void SetLUTErrorBudget(float max_delta_e);
+
+// Samples lut onto a lattice of size points per axis
+void SampleLUT(const LUTDesc& lut, uint32_t size, LUTDesc& sampled);
+
+// Resamples lut onto the smallest of the usual lattice sizes whose result stays
+// within max_delta_e of it at 99% of its points, returns false when none does
+// and lut is unchanged
+bool ResampleLUT(LUTDesc& lut, float max_delta_e);
+
+// Classifies a loaded lattice and fills the matching Curves or Grey tables
+void ClassifyLUT(LUTDesc& lut);
+
+// Resamples every lattice point of lut through next, mixed with the point in
+// linear light by strength, so that lut then applies both looks
+void ComposeLUT(LUTDesc& lut, const LUTDesc& next, float strength);
+
+const char* LUTClassName(LUTClass lut_class);
+
+// Decoded LUT and grain assets, shared with recent callers through a small cache
+// keyed by file contents, so that identical files under several names share
+// one decoded copy
+std::shared_ptr<const LUTDesc> AcquireLUT(const char* path);
+
+// The profile's LUT composed with its LUTChain, cached as one asset
+std::shared_ptr<const LUTDesc> AcquireLUT(const ProcessParams& process_params);
+
+std::shared_ptr<const ImageData> AcquireGrain(const char* path);
+
+// Grain frames kept decoded, 8 by default. Sequences raise it to the frames
+// they cycle through so that each is decoded once
+void SetGrainCacheCapacity(size_t frames);
+
+// Hash of the contents of a LUT or grain file, the one the asset cache keys
+// it by, 0 when the file cannot be read
+uint64_t LUTContentHash(const char* path);
+
+uint64_t GrainContentHash(const char* path);
+
+// Memory held by a decoded asset
+uint64_t DecodedSize(const LUTDesc& lut);
+
+uint64_t DecodedSize(const ImageData& image);
+
+struct AssetStats
+{
+    // Assets decoded by the cache
+    uint64_t Decoded;
+    // Acquires of a new path served by a decoded asset with the same contents
+    uint64_t Shared;
+    // Decoded bytes these shared acquires did not allocate
+    uint64_t SavedBytes;
+};
+
+void GetAssetStats(AssetStats& luts, AssetStats& grains);
+
+bool ProcessImage(ImageDesc& image, ProcessParams process_params);
+
+void ProcessImage(ImageDesc& image, const ProcessParams& process_params, const LUTDesc& lut, const ImageData& grain_image);
+
+// Colour cache lookups and hits over every ProcessImage call so far
+void ColourCacheStats(uint64_t& lookups, uint64_t& hits);
 
 }
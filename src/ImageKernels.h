@@ -0,0 +1,604 @@
+#pragma once
+
+// Per-pixel colour kernels of the CPU pipeline. Internal to Image.cpp, they
+// live in a header so that the benchmarks can inline and time them in isolation
+
+#include "Image.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace Image
+{
+
+inline float SRGB2Linear(float c)
+{
+    if (c <= 0.04045f)
+    {
+        return c / 12.92f;
+    }
+    return powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float Linear2SRGB(float c)
+{
+    if (c <= 0.0031308f)
+    {
+        return 12.92f * c;
+    }
+    return powf(c, 1.0f / 2.4f) * 1.055f - 0.055f;
+}
+
+inline float Clamp(float v, float min, float max)
+{
+    return v <= min ? min : v >= max ? max : v;
+}
+
+inline float Mix(float f0, float f1, float v)
+{
+    return f0 * v + f1 * (1.0f - v);
+}
+
+static const int TransferTableSize = 4096;
+
+// sRGB transfer tables over [0, 1], with one extra entry so that 1.0 can be
+// interpolated. ToLinear8 is exact for 8-bit inputs in every precision mode.
+struct TransferTables
+{
+    TransferTables();
+    float ToLinear8[256];
+    float ToLinear[TransferTableSize + 1];
+    float ToSRGB[TransferTableSize + 1];
+    uint8_t ToSRGB8[TransferTableSize + 1];
+};
+
+inline TransferTables::TransferTables()
+{
+    for (int i = 0; i < 256; ++i)
+    {
+        ToLinear8[i] = SRGB2Linear(i / 255.0f);
+    }
+
+    for (int i = 0; i <= TransferTableSize; ++i)
+    {
+        float c = (float)i / TransferTableSize;
+
+        ToLinear[i] = SRGB2Linear(c);
+        ToSRGB[i] = Linear2SRGB(c);
+        ToSRGB8[i] = (uint8_t)(Clamp(ToSRGB[i], 0.0f, 1.0f) * 255.0f);
+    }
+}
+
+inline const TransferTables& GetTransferTables()
+{
+    static const TransferTables s_TransferTables;
+    return s_TransferTables;
+}
+
+inline float LookupInterpolated(const float* table, float c)
+{
+    float x = Clamp(c, 0.0f, 1.0f) * TransferTableSize;
+    int i = std::min((int)x, TransferTableSize - 1);
+    return table[i] + (table[i + 1] - table[i]) * (x - i);
+}
+
+inline int LookupNearest(float c)
+{
+    return (int)(Clamp(c, 0.0f, 1.0f) * TransferTableSize + 0.5f);
+}
+
+inline float ToLinear(float c, ProcessPrecision precision, const TransferTables& tables)
+{
+    switch (precision)
+    {
+        case ProcessPrecisionExact: return SRGB2Linear(c);
+        case ProcessPrecisionBalanced: return LookupInterpolated(tables.ToLinear, c);
+        default: return tables.ToLinear[LookupNearest(c)];
+    }
+}
+
+// Linear to clamped 8-bit sRGB, truncating like the exact path
+inline uint8_t ToSRGB8(float c, ProcessPrecision precision, const TransferTables& tables)
+{
+    switch (precision)
+    {
+        case ProcessPrecisionExact: return (uint8_t)(Clamp(Linear2SRGB(c), 0.0f, 1.0f) * 255.0f);
+        case ProcessPrecisionBalanced: return (uint8_t)(Clamp(LookupInterpolated(tables.ToSRGB, c), 0.0f, 1.0f) * 255.0f);
+        default: return tables.ToSRGB8[LookupNearest(c)];
+    }
+}
+
+inline void HSV2RGB(const float* hsv, float* output)
+{
+    float hue = hsv[0];
+    float saturation = hsv[1];
+    float lightness = hsv[2];
+
+    if (saturation == 0.0f)
+    {
+        output[0] = output[1] = output[2] = lightness;
+        return;
+    }
+
+    float h = hue / 60.0f;
+    int i = (int)h;
+    float frac = h - i;
+    float p = lightness * (1.0f - saturation);
+    float q = lightness * (1.0f - saturation * frac);
+    float t = lightness * (1.0f - saturation * (1.0f - frac));
+
+    switch(i)
+    {
+        case 0:
+            output[0] = lightness;
+            output[1] = t;
+            output[2] = p;
+            break;
+        case 1:
+            output[0] = q;
+            output[1] = lightness;
+            output[2] = p;
+            break;
+        case 2:
+            output[0] = p;
+            output[1] = lightness;
+            output[2] = t;
+            break;
+        case 3:
+            output[0] = p;
+            output[1] = q;
+            output[2] = lightness;
+            break;
+        case 4:
+            output[0] = t;
+            output[1] = p;
+            output[2] = lightness;
+            break;
+        case 5:
+            output[0] = lightness;
+            output[1] = p;
+            output[2] = q;
+            break;
+        default:
+            assert(false);
+            break;
+    }
+}
+
+inline void RGB2HSV(const float* input, float* hsv)
+{
+    float K = 0.0f;
+    float r = input[0];
+    float g = input[1];
+    float b = input[2];
+
+    if (g < b)
+    {
+        std::swap(g, b);
+        K = -1.0f;
+    }
+    if (r < g)
+    {
+        std::swap(r, g);
+        K = -2.0f / 6.0f - K;
+    }
+    float chroma = r - std::min(g, b);
+    float hue = 360.0f * (K + (g - b) / (6.0f * chroma + 1e-20f));
+    if (hue < 0)
+    {
+        hue = -hue;
+    }
+    float saturation = (chroma / (r + std::numeric_limits<float>::epsilon()));
+    float lightness = r;
+
+    hsv[0] = hue;
+    hsv[1] = saturation;
+    hsv[2] = lightness;
+}
+
+inline void ApplyVignette(const float* input, float* output, float* uv)
+{
+    uv[0] *= 1.0 - uv[0];
+    uv[1] *= 1.0 - uv[1];
+
+    float vignette = pow(uv[0] * uv[1] * 15.0f, 0.15);
+
+    // TODO: dither (only on CPU pipeline)
+    output[0] = input[0] * vignette;
+    output[1] = input[1] * vignette;
+    output[2] = input[2] * vignette;
+}
+
+// pow(15 * u(1 - u) * v(1 - v), 0.15) factors into a term per row and one per
+// column, the approximate modes precompute both instead of a pow per pixel
+inline void ComputeVignetteFactors(int32_t size, float scale, std::vector<float>& factors)
+{
+    factors.resize(size);
+
+    for (int32_t i = 0; i < size; ++i)
+    {
+        double uv = i / double(size) + 0.5 / size;
+        factors[i] = (float)pow(scale * uv * (1.0 - uv), 0.15);
+    }
+}
+
+inline void ApplyGrain(const float* input, float* output, float* grain)
+{
+    auto BlendOverlay = [](float base, float blend) -> float
+    {
+        float strength = base > 0.5 ? 0.0 : 1.0;
+        return (1.0 - 2.0 * (1.0 - base) * (1.0 - blend)) * (1.0f - strength) + 2.0 * base * blend * strength;
+    };
+
+    output[0] = BlendOverlay(input[0], grain[0]);
+    output[1] = BlendOverlay(input[1], grain[1]);
+    output[2] = BlendOverlay(input[2], grain[2]);
+
+#if 0
+    float grain_strength = 0.25;
+    out_rgb[0] = out_rgb[0] * (1.0f - grain_strength) + grain_r * grain_strength;
+    out_rgb[1] = out_rgb[1] * (1.0f - grain_strength) + grain_g * grain_strength;
+    out_rgb[2] = out_rgb[2] * (1.0f - grain_strength) + grain_b * grain_strength;
+#endif
+}
+
+inline void ApplyLUT(const float* input, float* output, const float* clut, unsigned int size)
+{
+    int color, red, green, blue, i, j;
+    float tmp[6], r, g, b;
+
+    red = input[0] * (float)(size - 1);
+    if(red > size - 2)
+        red = (float)size - 2;
+    if(red < 0)
+        red = 0;
+
+    green = input[1] * (float)(size - 1);
+    if(green > size - 2)
+        green = (float)size - 2;
+    if(green < 0)
+        green = 0;
+
+    blue = input[2] * (float)(size - 1);
+    if(blue > size - 2)
+        blue = (float)size - 2;
+    if(blue < 0)
+        blue = 0;
+
+    r = input[0] * (float)(size - 1) - red;
+    g = input[1] * (float)(size - 1) - green;
+    b = input[2] * (float)(size - 1) - blue;
+
+    color = red + green * size + blue * size * size;
+
+    i = color * 3;
+    j = (color + 1) * 3;
+
+    tmp[0] = clut[i++] * (1 - r) + clut[j++] * r;
+    tmp[1] = clut[i++] * (1 - r) + clut[j++] * r;
+    tmp[2] = clut[i] * (1 - r) + clut[j] * r;
+
+    i = (color + size) * 3;
+    j = (color + size + 1) * 3;
+
+    tmp[3] = clut[i++] * (1 - r) + clut[j++] * r;
+    tmp[4] = clut[i++] * (1 - r) + clut[j++] * r;
+    tmp[5] = clut[i] * (1 - r) + clut[j] * r;
+
+    output[0] = tmp[0] * (1 - g) + tmp[3] * g;
+    output[1] = tmp[1] * (1 - g) + tmp[4] * g;
+    output[2] = tmp[2] * (1 - g) + tmp[5] * g;
+
+    i = (color + size * size) * 3;
+    j = (color + size * size + 1) * 3;
+
+    tmp[0] = clut[i++] * (1 - r) + clut[j++] * r;
+    tmp[1] = clut[i++] * (1 - r) + clut[j++] * r;
+    tmp[2] = clut[i] * (1 - r) + clut[j] * r;
+
+    i = (color + size + size * size) * 3;
+    j = (color + size + size * size + 1) * 3;
+
+    tmp[3] = clut[i++] * (1 - r) + clut[j++] * r;
+    tmp[4] = clut[i++] * (1 - r) + clut[j++] * r;
+    tmp[5] = clut[i] * (1 - r) + clut[j] * r;
+
+    tmp[0] = tmp[0] * (1 - g) + tmp[3] * g;
+    tmp[1] = tmp[1] * (1 - g) + tmp[4] * g;
+    tmp[2] = tmp[2] * (1 - g) + tmp[5] * g;
+
+    output[0] = output[0] * (1 - b) + tmp[0] * b;
+    output[1] = output[1] * (1 - b) + tmp[1] * b;
+    output[2] = output[2] * (1 - b) + tmp[2] * b;
+}
+
+// Tetrahedral interpolation, 4 lattice reads instead of the 8 of ApplyLUT,
+// exact on the lattice points and within a fraction of a step between them
+inline void ApplyLUTTetrahedral(const float* input, float* output, const float* clut, int size)
+{
+    float scale = (float)(size - 1);
+
+    float x[3];
+    int cell[3];
+
+    for (int c = 0; c < 3; ++c)
+    {
+        x[c] = input[c] * scale;
+        cell[c] = std::max(0, std::min((int)x[c], size - 2));
+        x[c] -= cell[c];
+    }
+
+    const int stride[3] = { 3, 3 * size, 3 * size * size };
+    const float* c000 = clut + cell[0] * stride[0] + cell[1] * stride[1] + cell[2] * stride[2];
+    const float* c111 = c000 + stride[0] + stride[1] + stride[2];
+
+    // Order the axes by decreasing fraction, the walk from c000 to c111 along
+    // them selects one of the six tetrahedra of the cell
+    int a = 0, b = 1, c = 2;
+
+    if (x[a] < x[b]) std::swap(a, b);
+    if (x[b] < x[c]) std::swap(b, c);
+    if (x[a] < x[b]) std::swap(a, b);
+
+    const float* c1 = c000 + stride[a];
+    const float* c2 = c1 + stride[b];
+
+    float w0 = 1.0f - x[a];
+    float w1 = x[a] - x[b];
+    float w2 = x[b] - x[c];
+    float w3 = x[c];
+
+    output[0] = c000[0] * w0 + c1[0] * w1 + c2[0] * w2 + c111[0] * w3;
+    output[1] = c000[1] * w0 + c1[1] * w1 + c2[1] * w2 + c111[1] * w3;
+    output[2] = c000[2] * w0 + c1[2] * w1 + c2[2] * w2 + c111[2] * w3;
+}
+
+// Linear interpolation in a curve of size entries over [0, 1]
+inline float SampleCurve(const float* curve, int size, float c)
+{
+    float x = c * (float)(size - 1);
+    int i = std::max(0, std::min((int)x, size - 2));
+    float f = x - i;
+
+    return curve[i] * (1 - f) + curve[i + 1] * f;
+}
+
+// Separable LUTs, one curve per channel instead of the 8 lattice reads per
+// channel of ApplyLUT
+inline void ApplyLUTSeparable(const float* input, float* output, const float* curves, int size)
+{
+    output[0] = SampleCurve(curves, size, input[0]);
+    output[1] = SampleCurve(curves + size, size, input[1]);
+    output[2] = SampleCurve(curves + 2 * size, size, input[2]);
+}
+
+// ApplyLUT over the single channel lattice of a monochrome LUT. It repeats
+// the arithmetic of ApplyLUT, so that a lattice with equal channels samples to
+// the same grey as the full one with a third of the reads.
+inline void ApplyLUTMonochrome(const float* input, float* output, const float* grey, int size)
+{
+    float scale = (float)(size - 1);
+
+    int red = std::max(0, std::min((int)(input[0] * scale), size - 2));
+    int green = std::max(0, std::min((int)(input[1] * scale), size - 2));
+    int blue = std::max(0, std::min((int)(input[2] * scale), size - 2));
+
+    float r = input[0] * scale - red;
+    float g = input[1] * scale - green;
+    float b = input[2] * scale - blue;
+
+    const float* c0 = grey + red + green * size + blue * size * size;
+    const float* c1 = c0 + size * size;
+
+    float x0 = c0[0] * (1 - r) + c0[1] * r;
+    float x1 = c0[size] * (1 - r) + c0[size + 1] * r;
+    float y0 = x0 * (1 - g) + x1 * g;
+
+    x0 = c1[0] * (1 - r) + c1[1] * r;
+    x1 = c1[size] * (1 - r) + c1[size + 1] * r;
+    float y1 = x0 * (1 - g) + x1 * g;
+
+    output[0] = output[1] = output[2] = y0 * (1 - b) + y1 * b;
+}
+
+// Fixed point pipeline. Colours are 16.16 values in 32-bit lanes rather than
+// 16-bit ones, since contrast and the overlay blend leave [0, 1] before the
+// final clamp. Weights and parameters are 12-bit fractions so that every
+// product of a colour and a weight fits 32 bits.
+static const int FixedShift = 16;
+static const int32_t FixedOne = 1 << FixedShift;
+static const int WeightShift = 12;
+static const int32_t WeightOne = 1 << WeightShift;
+// Intermediates are clamped to this, well beyond what the profile ranges reach
+static const int32_t FixedLimit = 2 * FixedOne;
+static const int FixedTableShift = FixedShift - 12;
+
+static_assert(TransferTableSize == 1 << 12, "The fixed point transfer table is indexed by the top 12 bits");
+
+inline int32_t ToWeight(float v)
+{
+    return (int32_t)lroundf(v * WeightOne);
+}
+
+// Product of a colour and a weight, rounded rather than floored so that the
+// error of successive stages does not drift one way
+inline int32_t MulWeight(int32_t value, int32_t weight)
+{
+    return (value * weight + WeightOne / 2) >> WeightShift;
+}
+
+struct FixedTables
+{
+    FixedTables();
+    // 8-bit sRGB to 16.16 linear
+    int32_t ToLinear8[256];
+    // 16.16 sRGB to 16.16 linear, interpolated
+    int32_t ToLinear[TransferTableSize + 1];
+    // 8-bit value to a 12-bit fraction
+    int32_t Weight8[256];
+    // 16.16 linear to clamped 8-bit sRGB
+    uint8_t ToSRGB8[FixedOne + 1];
+};
+
+inline FixedTables::FixedTables()
+{
+    for (int i = 0; i < 256; ++i)
+    {
+        ToLinear8[i] = (int32_t)lround(SRGB2Linear(i / 255.0f) * FixedOne);
+        Weight8[i] = (int32_t)lround(i * WeightOne / 255.0);
+    }
+
+    for (int i = 0; i <= TransferTableSize; ++i)
+    {
+        ToLinear[i] = (int32_t)lround(SRGB2Linear((float)i / TransferTableSize) * FixedOne);
+    }
+
+    for (int i = 0; i <= FixedOne; ++i)
+    {
+        ToSRGB8[i] = (uint8_t)(Clamp(Linear2SRGB((float)i / FixedOne), 0.0f, 1.0f) * 255.0f);
+    }
+}
+
+inline const FixedTables& GetFixedTables()
+{
+    static const FixedTables s_FixedTables;
+    return s_FixedTables;
+}
+
+inline int32_t ToLinearFixed(uint32_t c, const FixedTables& tables)
+{
+    uint32_t i = std::min(c >> FixedTableShift, (uint32_t)TransferTableSize - 1);
+    int32_t frac = c - (i << FixedTableShift);
+    return tables.ToLinear[i] + (((tables.ToLinear[i + 1] - tables.ToLinear[i]) * frac) >> FixedTableShift);
+}
+
+// Lattice cell and 12-bit weight along one axis for every 8-bit input, with
+// the same rounding and clamping as ApplyLUT
+inline void ComputeLatticeAxis(int size, int32_t* cells, int32_t* weights)
+{
+    for (int i = 0; i < 256; ++i)
+    {
+        float x = i / 255.0f * (float)(size - 1);
+        int cell = std::max(0, std::min((int)x, size - 2));
+
+        cells[i] = cell;
+        weights[i] = ToWeight(x - cell);
+    }
+}
+
+// Trilinear sampling of the 8-bit lattice, the result is in 8-bit units with
+// a 12-bit fraction. Every intermediate fits an unsigned 32-bit lane. A single
+// channel samples only the first one of a monochrome lattice and copies it.
+inline void ApplyLUTFixed(const uint8_t* input, uint32_t* output, const uint8_t* lattice, const int32_t* cells, const int32_t* weights, int size, int channels)
+{
+    uint32_t wr = weights[input[0]];
+    uint32_t wg = weights[input[1]];
+    uint32_t wb = weights[input[2]];
+
+    int stride_g = 3 * size;
+    int stride_b = 3 * size * size;
+
+    const uint8_t* c000 = lattice + 3 * cells[input[0]] + stride_g * cells[input[1]] + stride_b * cells[input[2]];
+
+    for (int c = 0; c < channels; ++c)
+    {
+        const uint8_t* c0 = c000 + c;
+        const uint8_t* c1 = c0 + stride_b;
+
+        uint32_t x00 = c0[0] * (WeightOne - wr) + c0[3] * wr;
+        uint32_t x10 = c0[stride_g] * (WeightOne - wr) + c0[stride_g + 3] * wr;
+        uint32_t x01 = c1[0] * (WeightOne - wr) + c1[3] * wr;
+        uint32_t x11 = c1[stride_g] * (WeightOne - wr) + c1[stride_g + 3] * wr;
+
+        uint32_t y0 = (x00 * (WeightOne - wg) + x10 * wg + WeightOne / 2) >> WeightShift;
+        uint32_t y1 = (x01 * (WeightOne - wg) + x11 * wg + WeightOne / 2) >> WeightShift;
+
+        output[c] = (y0 * (WeightOne - wb) + y1 * wb + WeightOne / 2) >> WeightShift;
+    }
+
+    for (int c = channels; c < 3; ++c)
+    {
+        output[c] = output[0];
+    }
+}
+
+// 8-bit units with a 12-bit fraction to 16.16, 4112 / 65536 being 16 / 255
+inline uint32_t LatticeToFixed(uint32_t c)
+{
+    return (c * 4112u + 0x8000u) >> 16;
+}
+
+// RGB2HSV, scale, HSV2RGB on 16.16 colours. Hue in sixths of a turn and
+// saturation are 16-bit fractions too, as are the scales, and the products go
+// through 64 bits: the darkest tones end up an order of magnitude more
+// sensitive after contrast than 12-bit fractions allow.
+inline void AdjustHSVFixed(int32_t* rgb, int32_t hue, int32_t saturation, int32_t lightness)
+{
+    int64_t r = rgb[0];
+    int64_t g = rgb[1];
+    int64_t b = rgb[2];
+    int64_t k = 0;
+
+    if (g < b)
+    {
+        std::swap(g, b);
+        k = -6 * (int64_t)FixedOne;
+    }
+    if (r < g)
+    {
+        std::swap(r, g);
+        k = -2 * (int64_t)FixedOne - k;
+    }
+
+    int64_t chroma = r - std::min(g, b);
+    int64_t h = std::abs(k + (chroma > 0 ? ((g - b) << FixedShift) / chroma : 0));
+    int64_t s = r > 0 ? (chroma << FixedShift) / r : 0;
+    int64_t v = r;
+
+    h = (h * hue + FixedOne / 2) >> FixedShift;
+    s = (s * saturation + FixedOne / 2) >> FixedShift;
+    v = (v * lightness + FixedOne / 2) >> FixedShift;
+
+    if (s == 0)
+    {
+        rgb[0] = rgb[1] = rgb[2] = (int32_t)v;
+        return;
+    }
+
+    int64_t i = h >> FixedShift;
+    int64_t frac = h & (FixedOne - 1);
+
+    if (i > 5)
+    {
+        i = 5;
+        frac = FixedOne;
+    }
+
+    int32_t p = (int32_t)((v * (FixedOne - s) + FixedOne / 2) >> FixedShift);
+    int32_t q = (int32_t)((v * (FixedOne - ((s * frac) >> FixedShift)) + FixedOne / 2) >> FixedShift);
+    int32_t t = (int32_t)((v * (FixedOne - ((s * (FixedOne - frac)) >> FixedShift)) + FixedOne / 2) >> FixedShift);
+    int32_t l = (int32_t)v;
+
+    switch(i)
+    {
+        case 0: rgb[0] = l; rgb[1] = t; rgb[2] = p; break;
+        case 1: rgb[0] = q; rgb[1] = l; rgb[2] = p; break;
+        case 2: rgb[0] = p; rgb[1] = l; rgb[2] = t; break;
+        case 3: rgb[0] = p; rgb[1] = q; rgb[2] = l; break;
+        case 4: rgb[0] = t; rgb[1] = p; rgb[2] = l; break;
+        default: rgb[0] = l; rgb[1] = p; rgb[2] = q; break;
+    }
+}
+
+inline int32_t BlendOverlayFixed(int32_t base, int32_t blend)
+{
+    return base > FixedOne / 2
+        ? FixedOne - 2 * MulWeight(FixedOne - base, WeightOne - blend)
+        : 2 * MulWeight(base, blend);
+}
+
+}
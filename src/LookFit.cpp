@@ -0,0 +1,666 @@
+#include "LookFit.h"
+#include "ImageKernels.h"
+#include "LUTs.h"
+#include "Parallel.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+
+#define ARRAYSIZE(_ARR) ((int)(sizeof(_ARR) / sizeof(*_ARR)))
+
+namespace LookFit
+{
+
+// Lattice points of the 3x3x3 neighbourhood a pixel pair couples a point with
+static const int StencilSize = 27;
+
+// Weight of the pull towards identity, only felt far from every pixel
+static const double IdentityWeight = 1e-6;
+
+static const int MaxSolverIterations = 1000;
+
+// Longest edge of the images the profile params are fitted on
+static const int32_t ProfileFitSize = 128;
+
+// Longest edge of the images the error of a fit is measured on
+static const int32_t ErrorSize = 1024;
+
+// Looks of the index tried as the base of a profile, and chained after it
+static const int ProfileCandidates = 3;
+
+FitOptions::FitOptions()
+    : Level(5)
+    , Smoothness(0.1f)
+{
+}
+
+static void ReadRGB(const uint8_t* pixel, int32_t comp, uint8_t* rgb)
+{
+    // Grey pixels repeat their one channel
+    for (int c = 0; c < 3; ++c)
+    {
+        rgb[c] = pixel[comp < 3 ? 0 : c];
+    }
+}
+
+// Normal equations of the data term, the 27 point stencil of every lattice
+// point and the right hand side
+struct NormalEquations
+{
+    std::vector<double> Matrix;
+    std::vector<double> RHS;
+};
+
+static void AccumulatePixel(const uint8_t* before, const uint8_t* after, int size, NormalEquations& equations)
+{
+    const float scale = (size - 1) / 255.0f;
+
+    int cell[3];
+    float fraction[3];
+
+    for (int c = 0; c < 3; ++c)
+    {
+        float x = before[c] * scale;
+        cell[c] = std::min((int)x, size - 2);
+        fraction[c] = x - cell[c];
+    }
+
+    int points[8];
+    double weights[8];
+
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        double weight = 1.0;
+        int point = 0;
+
+        for (int c = 2; c >= 0; --c)
+        {
+            int bit = (corner >> c) & 1;
+            weight *= bit ? fraction[c] : 1.0f - fraction[c];
+            point = point * size + cell[c] + bit;
+        }
+
+        points[corner] = point;
+        weights[corner] = weight;
+    }
+
+    for (int a = 0; a < 8; ++a)
+    {
+        double* matrix = &equations.Matrix[points[a] * StencilSize];
+        double* rhs = &equations.RHS[points[a] * 3];
+
+        rhs[0] += weights[a] * after[0];
+        rhs[1] += weights[a] * after[1];
+        rhs[2] += weights[a] * after[2];
+
+        for (int b = 0; b < 8; ++b)
+        {
+            // Stencil entry of the offset from corner a to corner b
+            int stencil = 13 + ((b & 1) - (a & 1)) + (((b >> 1) & 1) - ((a >> 1) & 1)) * 3 + (((b >> 2) & 1) - ((a >> 2) & 1)) * 9;
+
+            matrix[stencil] += weights[a] * weights[b];
+        }
+    }
+}
+
+// Adds weight times the squared second differences of x along each axis,
+// differentiated, to y
+static void ApplyCurvature(const double* x, double* y, int size, double weight, int b)
+{
+    const int stride[3] = { 1, size, size * size };
+
+    for (int g = 0; g < size; ++g)
+    {
+        for (int r = 0; r < size; ++r)
+        {
+            int coordinates[3] = { r, g, b };
+            int point = r + g * size + b * size * size;
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                // Point in the middle, at the start and at the end of a triple
+                int x_axis = coordinates[axis];
+                int s = stride[axis];
+
+                for (int c = 0; c < 3; ++c)
+                {
+                    double value = 0.0;
+
+                    if (x_axis >= 1 && x_axis <= size - 2)
+                    {
+                        value -= 2.0 * (x[(point - s) * 3 + c] - 2.0 * x[point * 3 + c] + x[(point + s) * 3 + c]);
+                    }
+
+                    if (x_axis <= size - 3)
+                    {
+                        value += x[point * 3 + c] - 2.0 * x[(point + s) * 3 + c] + x[(point + 2 * s) * 3 + c];
+                    }
+
+                    if (x_axis >= 2)
+                    {
+                        value += x[(point - 2 * s) * 3 + c] - 2.0 * x[(point - s) * 3 + c] + x[point * 3 + c];
+                    }
+
+                    y[point * 3 + c] += weight * value;
+                }
+            }
+        }
+    }
+}
+
+bool FitLUT(const Image::ImageData& before, const Image::ImageData& after, const FitOptions& options, Image::LUTDesc& lut)
+{
+    TRACE_SCOPE("FitLUT");
+
+    if (before.Width != after.Width || before.Height != after.Height)
+    {
+        fprintf(stderr, "Before and after images differ in size, %dx%d and %dx%d\n", before.Width, before.Height, after.Width, after.Height);
+        return false;
+    }
+
+    int level = std::max(2, std::min(options.Level, 8));
+    int size = level * level;
+    int points = size * size * size;
+    int bands = std::min<int>(Parallel::WorkerCount(), before.Height);
+
+    std::vector<NormalEquations> band_equations(bands);
+
+    {
+        TRACE_SCOPE("FitAccumulate");
+
+        Parallel::For(bands, [&](int band)
+        {
+            NormalEquations& equations = band_equations[band];
+            equations.Matrix.assign((size_t)points * StencilSize, 0.0);
+            equations.RHS.assign((size_t)points * 3, 0.0);
+
+            int32_t row_begin = before.Height * band / bands;
+            int32_t row_end = before.Height * (band + 1) / bands;
+
+            for (int32_t y = row_begin; y < row_end; ++y)
+            {
+                const uint8_t* before_row = before.Pixels + (size_t)y * before.Width * before.Comp;
+                const uint8_t* after_row = after.Pixels + (size_t)y * after.Width * after.Comp;
+
+                for (int32_t x = 0; x < before.Width; ++x)
+                {
+                    uint8_t before_rgb[3], after_rgb[3];
+
+                    ReadRGB(before_row + x * before.Comp, before.Comp, before_rgb);
+                    ReadRGB(after_row + x * after.Comp, after.Comp, after_rgb);
+
+                    AccumulatePixel(before_rgb, after_rgb, size, equations);
+                }
+            }
+        });
+    }
+
+    // The data term is a mean over the pixels
+    NormalEquations& equations = band_equations[0];
+    double pixel_scale = 1.0 / ((double)before.Width * before.Height);
+
+    for (int band = 1; band < bands; ++band)
+    {
+        for (size_t i = 0; i < equations.Matrix.size(); ++i) equations.Matrix[i] += band_equations[band].Matrix[i];
+        for (size_t i = 0; i < equations.RHS.size(); ++i) equations.RHS[i] += band_equations[band].RHS[i];
+
+        band_equations[band] = NormalEquations();
+    }
+
+    for (double& value : equations.Matrix) value *= pixel_scale;
+    for (double& value : equations.RHS) value *= pixel_scale / 255.0;
+
+    // The curvature weight is relative to the mean data weight of a point, so
+    // that it holds across lattice sizes and images
+    double data_weight = 0.0;
+
+    for (int point = 0; point < points; ++point)
+    {
+        data_weight += equations.Matrix[point * StencilSize + 13];
+    }
+
+    double curvature_weight = options.Smoothness * data_weight / points;
+    double identity_weight = IdentityWeight / points;
+
+    std::vector<double> identity(points * 3);
+
+    for (int b = 0, index = 0; b < size; ++b)
+    {
+        for (int g = 0; g < size; ++g)
+        {
+            for (int r = 0; r < size; ++r, index += 3)
+            {
+                identity[index + 0] = r / (double)(size - 1);
+                identity[index + 1] = g / (double)(size - 1);
+                identity[index + 2] = b / (double)(size - 1);
+            }
+        }
+    }
+
+    for (int i = 0; i < points * 3; ++i)
+    {
+        equations.RHS[i] += identity_weight * identity[i];
+    }
+
+    // Operator of the whole system, one slice of blue per task
+    auto apply = [&](const std::vector<double>& x, std::vector<double>& y)
+    {
+        Parallel::For(size, [&](int b)
+        {
+            for (int point = b * size * size; point < (b + 1) * size * size; ++point)
+            {
+                const double* matrix = &equations.Matrix[point * StencilSize];
+
+                for (int c = 0; c < 3; ++c)
+                {
+                    y[point * 3 + c] = identity_weight * x[point * 3 + c];
+                }
+
+                for (int stencil = 0; stencil < StencilSize; ++stencil)
+                {
+                    // Zero outside the lattice as no pixel couples across it
+                    if (matrix[stencil] == 0.0) continue;
+
+                    int neighbour = point + (stencil % 3 - 1) + (stencil / 3 % 3 - 1) * size + (stencil / 9 - 1) * size * size;
+
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        y[point * 3 + c] += matrix[stencil] * x[neighbour * 3 + c];
+                    }
+                }
+            }
+
+            ApplyCurvature(x.data(), y.data(), size, curvature_weight, b);
+        });
+    };
+
+    // Jacobi preconditioner, the curvature term adds up to 1 + 4 + 1 per axis
+    std::vector<double> inverse_diagonal(points);
+
+    for (int b = 0, point = 0; b < size; ++b)
+    {
+        for (int g = 0; g < size; ++g)
+        {
+            for (int r = 0; r < size; ++r, ++point)
+            {
+                double curvature = 0.0;
+
+                for (int x : { r, g, b })
+                {
+                    curvature += (x >= 1 && x <= size - 2 ? 4.0 : 0.0) + (x <= size - 3 ? 1.0 : 0.0) + (x >= 2 ? 1.0 : 0.0);
+                }
+
+                inverse_diagonal[point] = 1.0 / (equations.Matrix[point * StencilSize + 13] + curvature_weight * curvature + identity_weight);
+            }
+        }
+    }
+
+    // Preconditioned conjugate gradients from identity, the three channels
+    // stepping together with their own step lengths
+    std::vector<double> x = identity;
+    std::vector<double> residual(points * 3), z(points * 3), direction(points * 3), product(points * 3);
+
+    {
+        TRACE_SCOPE("FitSolve");
+
+        apply(x, product);
+
+        double rz[3] = { 0.0, 0.0, 0.0 };
+        double rhs_norm[3] = { 0.0, 0.0, 0.0 };
+
+        for (int i = 0; i < points * 3; ++i)
+        {
+            residual[i] = equations.RHS[i] - product[i];
+            z[i] = residual[i] * inverse_diagonal[i / 3];
+            direction[i] = z[i];
+            rz[i % 3] += residual[i] * z[i];
+            rhs_norm[i % 3] += equations.RHS[i] * equations.RHS[i];
+        }
+
+        for (int iteration = 0; iteration < MaxSolverIterations; ++iteration)
+        {
+            apply(direction, product);
+
+            double dp[3] = { 0.0, 0.0, 0.0 };
+
+            for (int i = 0; i < points * 3; ++i)
+            {
+                dp[i % 3] += direction[i] * product[i];
+            }
+
+            double alpha[3], residual_norm[3] = { 0.0, 0.0, 0.0 }, rz_next[3] = { 0.0, 0.0, 0.0 };
+
+            for (int c = 0; c < 3; ++c)
+            {
+                alpha[c] = dp[c] > 0.0 ? rz[c] / dp[c] : 0.0;
+            }
+
+            for (int i = 0; i < points * 3; ++i)
+            {
+                x[i] += alpha[i % 3] * direction[i];
+                residual[i] -= alpha[i % 3] * product[i];
+                z[i] = residual[i] * inverse_diagonal[i / 3];
+                residual_norm[i % 3] += residual[i] * residual[i];
+                rz_next[i % 3] += residual[i] * z[i];
+            }
+
+            bool converged = true;
+
+            for (int c = 0; c < 3; ++c)
+            {
+                converged = converged && residual_norm[c] <= 1e-14 * rhs_norm[c];
+            }
+
+            if (converged) break;
+
+            for (int i = 0; i < points * 3; ++i)
+            {
+                double beta = rz[i % 3] > 0.0 ? rz_next[i % 3] / rz[i % 3] : 0.0;
+                direction[i] = z[i] + beta * direction[i];
+            }
+
+            std::copy(rz_next, rz_next + 3, rz);
+        }
+    }
+
+    lut.Level = level;
+    lut.Size = size;
+    lut.Cube.resize(points * 3);
+    lut.Lattice.resize(points * 3);
+
+    for (int i = 0; i < points * 3; ++i)
+    {
+        lut.Cube[i] = Image::Clamp((float)x[i], 0.0f, 1.0f);
+        lut.Lattice[i] = (uint8_t)lroundf(lut.Cube[i] * 255.0f);
+    }
+
+    Image::ClassifyLUT(lut);
+
+    return true;
+}
+
+// L*a*b* of every pixel of an 8-bit image
+static void PixelsToLab(const uint8_t* pixels, int32_t comp, size_t pixel_count, std::vector<float>& lab)
+{
+    lab.resize(pixel_count * 3);
+
+    for (size_t i = 0; i < pixel_count; ++i)
+    {
+        uint8_t rgb[3];
+        ReadRGB(&pixels[i * comp], comp, rgb);
+
+        float colour[3] = { rgb[0] / 255.0f, rgb[1] / 255.0f, rgb[2] / 255.0f };
+        Image::SRGBToLab(colour, &lab[i * 3]);
+    }
+}
+
+static float MeanDeltaE(const Image::ImageDesc& processed, const std::vector<float>& after_lab)
+{
+    size_t pixel_count = after_lab.size() / 3;
+    std::vector<float> lab;
+
+    PixelsToLab(processed.ScratchData, Image::OutputComp(processed.Data.Comp), pixel_count, lab);
+
+    double sum = 0.0;
+
+    for (size_t i = 0; i < pixel_count * 3; i += 3)
+    {
+        float dl = lab[i + 0] - after_lab[i + 0];
+        float da = lab[i + 1] - after_lab[i + 1];
+        float db = lab[i + 2] - after_lab[i + 2];
+
+        sum += std::sqrt(dl * dl + da * da + db * db);
+    }
+
+    return pixel_count ? (float)(sum / pixel_count) : 0.0f;
+}
+
+static void Thumbnail(const Image::ImageData& image, int32_t max_size, std::vector<uint8_t>& pixels, Image::ImageData& thumbnail)
+{
+    thumbnail.Comp = image.Comp;
+    Image::FitSize(image.Width, image.Height, max_size, thumbnail.Width, thumbnail.Height);
+    pixels.resize((size_t)thumbnail.Width * thumbnail.Height * thumbnail.Comp);
+    Image::ResizePixels(image.Pixels, image.Width, image.Height, image.Comp, pixels.data(), thumbnail.Width, thumbnail.Height);
+    thumbnail.Pixels = pixels.data();
+}
+
+float MeanDeltaE(const Image::ImageData& before, const Image::ImageData& after, const Image::ProcessParams& process_params, const Image::LUTDesc& lut)
+{
+    std::vector<uint8_t> before_pixels, after_pixels;
+    Image::ImageData before_thumbnail, after_thumbnail;
+
+    Thumbnail(before, ErrorSize, before_pixels, before_thumbnail);
+    Thumbnail(after, ErrorSize, after_pixels, after_thumbnail);
+
+    std::vector<float> after_lab;
+    PixelsToLab(after_thumbnail.Pixels, after_thumbnail.Comp, (size_t)after_thumbnail.Width * after_thumbnail.Height, after_lab);
+
+    Image::ProcessParams colour_params = process_params;
+    colour_params.Filters &= Image::ProcessFilterLUT | Image::ProcessFilterHSV | Image::ProcessFilterBrightness | Image::ProcessFilterContrast;
+
+    Image::ImageData no_grain;
+    Image::ImageDesc processed;
+    processed.Data = before_thumbnail;
+
+    Image::ProcessImage(processed, colour_params, lut, no_grain);
+
+    return MeanDeltaE(processed, after_lab);
+}
+
+// A profile under test, a base look with optionally one look chained after it
+struct ProfileCandidate
+{
+    // Indices in LUTs[]
+    int Base;
+    int Chained;
+    // LUT strength, chained strength, saturation, lightness, brightness, contrast
+    float Params[6];
+    float Error;
+};
+
+static const float ParamMin[6] = { 0.0f, 0.0f, 0.0f, 0.0f, -0.5f, 0.0f };
+static const float ParamMax[6] = { 1.0f, 1.0f, 2.0f, 2.0f, 0.5f, 2.0f };
+
+static void ApplyParams(const ProfileCandidate& candidate, Image::ProcessParams& process_params)
+{
+    process_params.LUTFile = LUTs[candidate.Base];
+    process_params.LUTIndex = candidate.Base;
+    process_params.LUTStrength = candidate.Params[0];
+    process_params.Saturation = candidate.Params[2];
+    process_params.Lightness = candidate.Params[3];
+    process_params.Brightness = candidate.Params[4];
+    process_params.Contrast = candidate.Params[5];
+    process_params.LUTChain.clear();
+
+    if (candidate.Chained >= 0)
+    {
+        process_params.LUTChain.push_back({ candidate.Chained, candidate.Params[1] });
+    }
+}
+
+// Coordinate descent over the params of a candidate, halving the step each
+// time none of them improves the fit
+static void FitCandidate(ProfileCandidate& candidate, const Image::ImageData& before, const std::vector<float>& after_lab, const Image::LUTDesc& base, const Image::LUTDesc* chained)
+{
+    Image::ImageData no_grain;
+    Image::LUTDesc composed;
+
+    auto evaluate = [&](const float* params)
+    {
+        ProfileCandidate trial = candidate;
+        std::copy(params, params + 6, trial.Params);
+
+        Image::ProcessParams process_params;
+        ApplyParams(trial, process_params);
+        process_params.Filters = Image::ProcessFilterLUT | Image::ProcessFilterHSV | Image::ProcessFilterBrightness | Image::ProcessFilterContrast;
+
+        const Image::LUTDesc* lut = &base;
+
+        if (chained)
+        {
+            composed = base;
+            Image::ComposeLUT(composed, *chained, params[1]);
+            lut = &composed;
+        }
+
+        Image::ImageDesc processed;
+        processed.Data = before;
+
+        Image::ProcessImage(processed, process_params, *lut, no_grain);
+
+        return MeanDeltaE(processed, after_lab);
+    };
+
+    float params[6] = { 1.0f, 0.5f, 1.0f, 1.0f, 0.0f, 1.0f };
+    int param_count = chained ? 6 : 5;
+    const int param_order[6] = { 0, 2, 3, 4, 5, 1 };
+
+    candidate.Error = evaluate(params);
+
+    for (float step = 0.25f; step >= 1.0f / 128.0f;)
+    {
+        bool improved = false;
+
+        for (int p = 0; p < param_count; ++p)
+        {
+            int param = param_order[p];
+
+            for (float direction : { 1.0f, -1.0f })
+            {
+                float trial[6];
+                std::copy(params, params + 6, trial);
+                trial[param] = Image::Clamp(params[param] + direction * step, ParamMin[param], ParamMax[param]);
+
+                if (trial[param] == params[param]) continue;
+
+                float error = evaluate(trial);
+
+                if (error < candidate.Error)
+                {
+                    std::copy(trial, trial + 6, params);
+                    candidate.Error = error;
+                    improved = true;
+                    break;
+                }
+            }
+        }
+
+        if (!improved) step *= 0.5f;
+    }
+
+    std::copy(params, params + 6, candidate.Params);
+}
+
+bool FitProfile(const Image::ImageData& before, const Image::ImageData& after, const LookIndex::IndexDesc& index, Image::ProcessParams& process_params, float& error)
+{
+    TRACE_SCOPE("FitProfile");
+
+    if (before.Width != after.Width || before.Height != after.Height)
+    {
+        fprintf(stderr, "Before and after images differ in size, %dx%d and %dx%d\n", before.Width, before.Height, after.Width, after.Height);
+        return false;
+    }
+
+    std::vector<float> signature(LookIndex::SignatureSize), weights(LookIndex::SignatureSize);
+
+    if (!LookIndex::PairSignature(before, after, signature.data(), weights.data())) return false;
+
+    std::vector<int> looks;
+
+    for (const LookIndex::Match& match : LookIndex::Nearest(index, signature.data(), weights.data(), ProfileCandidates))
+    {
+        int look = (int)(std::find(LUTs, LUTs + ARRAYSIZE(LUTs), index.Paths[match.Entry]) - LUTs);
+
+        if (look < ARRAYSIZE(LUTs)) looks.push_back(look);
+    }
+
+    if (looks.empty())
+    {
+        fprintf(stderr, "No indexed look to fit a profile from\n");
+        return false;
+    }
+
+    std::vector<std::shared_ptr<const Image::LUTDesc>> luts;
+
+    for (int look : looks)
+    {
+        luts.push_back(Image::AcquireLUT(LUTs[look]));
+
+        if (!luts.back()) return false;
+    }
+
+    // Candidates and the entries of luts they use
+    std::vector<ProfileCandidate> candidates;
+    std::vector<std::pair<int, int>> candidate_luts;
+
+    for (size_t i = 0; i < looks.size(); ++i)
+    {
+        candidates.push_back({ looks[i], -1, {}, 0.0f });
+        candidate_luts.emplace_back((int)i, -1);
+
+        for (size_t j = 0; j < looks.size(); ++j)
+        {
+            if (j == i) continue;
+
+            candidates.push_back({ looks[i], looks[j], {}, 0.0f });
+            candidate_luts.emplace_back((int)i, (int)j);
+        }
+    }
+
+    std::vector<uint8_t> before_pixels, after_pixels;
+    Image::ImageData before_thumbnail, after_thumbnail;
+
+    Thumbnail(before, ProfileFitSize, before_pixels, before_thumbnail);
+    Thumbnail(after, ProfileFitSize, after_pixels, after_thumbnail);
+
+    std::vector<float> after_lab;
+    PixelsToLab(after_thumbnail.Pixels, after_thumbnail.Comp, (size_t)after_thumbnail.Width * after_thumbnail.Height, after_lab);
+
+    // Composing a chained look at every step is costly at the loaded lattice
+    // size, the fit composes onto a coarser copy of each base
+    std::vector<Image::LUTDesc> coarse_luts(luts.size());
+
+    for (size_t i = 0; i < luts.size(); ++i)
+    {
+        Image::SampleLUT(*luts[i], 17, coarse_luts[i]);
+    }
+
+    Parallel::For((int)candidates.size(), [&](int i)
+    {
+        int base = candidate_luts[i].first;
+        int chained = candidate_luts[i].second;
+
+        if (chained < 0)
+        {
+            FitCandidate(candidates[i], before_thumbnail, after_lab, *luts[base], nullptr);
+        }
+        else
+        {
+            FitCandidate(candidates[i], before_thumbnail, after_lab, coarse_luts[base], luts[chained].get());
+        }
+    });
+
+    ProfileCandidate best = *std::min_element(candidates.begin(), candidates.end(), [](const ProfileCandidate& a, const ProfileCandidate& b)
+    {
+        return a.Error < b.Error;
+    });
+
+    process_params = Image::ProcessParams();
+    ApplyParams(best, process_params);
+
+    // The fit composed chained looks onto coarse lattices, the error is that
+    // of the looks at their own lattice size
+    auto lut = Image::AcquireLUT(process_params);
+
+    if (!lut) return false;
+
+    error = MeanDeltaE(before, after, process_params, *lut);
+
+    return true;
+}
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Image.h"
+#include "LookIndex.h"
+
+namespace LookFit
+{
+
+struct FitOptions
+{
+    FitOptions();
+    // Hald level of the fitted LUT, Level * Level lattice points per axis
+    int Level;
+    // Weight of the curvature penalty that keeps the lattice smooth and fills
+    // the colours the pair does not show
+    float Smoothness;
+};
+
+// Solves for the LUT that best turns before into after, a regularised least
+// squares fit of the lattice to every pixel pair. Unused lattice points follow
+// their neighbours and fall back to identity far from any pixel
+bool FitLUT(const Image::ImageData& before, const Image::ImageData& after, const FitOptions& options, Image::LUTDesc& lut);
+
+// Picks the looks of index nearest to the pair and fits, for each look and each
+// look chained with another, the LUT strength and the HSV, brightness and
+// contrast params. process_params receives the closest of these profiles and
+// error its mean CIE76 difference from after
+bool FitProfile(const Image::ImageData& before, const Image::ImageData& after, const LookIndex::IndexDesc& index, Image::ProcessParams& process_params, float& error);
+
+// Mean CIE76 difference from after of before through the colour stages of
+// process_params with lut, measured on copies of both fitting 1024 pixels
+float MeanDeltaE(const Image::ImageData& before, const Image::ImageData& after, const Image::ProcessParams& process_params, const Image::LUTDesc& lut);
+
+}
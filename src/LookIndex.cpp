@@ -0,0 +1,403 @@
+#include "LookIndex.h"
+#include "ImageKernels.h"
+#include "Parallel.h"
+#include "Trace.h"
+#include "Util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/stat.h>
+
+namespace LookIndex
+{
+
+static const char IndexMagic[8] = { 'D', 'S', 'I', 'P', 'L', 'O', 'O', 'K' };
+static const uint32_t IndexVersion = 1;
+
+static uint64_t ModificationTime(const struct stat& file_stat)
+{
+#ifdef __APPLE__
+    const timespec& time = file_stat.st_mtimespec;
+#else
+    const timespec& time = file_stat.st_mtim;
+#endif
+    return (uint64_t)time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+void Signature(const Image::LUTDesc& lut, float* signature)
+{
+    float scale = 1.0f / (SignaturePoints - 1);
+
+    for (int b = 0, index = 0; b < SignaturePoints; ++b)
+    {
+        for (int g = 0; g < SignaturePoints; ++g)
+        {
+            for (int r = 0; r < SignaturePoints; ++r, index += 3)
+            {
+                float rgb[3] = { r * scale, g * scale, b * scale };
+                float output[3];
+
+                Image::ApplyLUT(rgb, output, lut.Cube.data(), lut.Size);
+                Image::SRGBToLab(output, &signature[index]);
+            }
+        }
+    }
+}
+
+// Adds the after colour of a pixel to the 8 sample points around its before
+// colour, weighted trilinearly
+static void SplatPixel(const uint8_t* before, const uint8_t* after, double* sums)
+{
+    const float scale = (SignaturePoints - 1) / 255.0f;
+
+    int cell[3];
+    float fraction[3];
+
+    for (int c = 0; c < 3; ++c)
+    {
+        float x = before[c] * scale;
+        cell[c] = std::min((int)x, SignaturePoints - 2);
+        fraction[c] = x - cell[c];
+    }
+
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        float weight = 1.0f;
+        int point = 0;
+
+        for (int c = 2; c >= 0; --c)
+        {
+            int bit = (corner >> c) & 1;
+            weight *= bit ? fraction[c] : 1.0f - fraction[c];
+            point = point * SignaturePoints + cell[c] + bit;
+        }
+
+        double* sum = &sums[point * 4];
+        sum[0] += weight * after[0];
+        sum[1] += weight * after[1];
+        sum[2] += weight * after[2];
+        sum[3] += weight;
+    }
+}
+
+bool PairSignature(const Image::ImageData& before, const Image::ImageData& after, float* signature, float* weights)
+{
+    TRACE_SCOPE("PairSignature");
+
+    if (before.Width != after.Width || before.Height != after.Height)
+    {
+        fprintf(stderr, "Before and after images differ in size, %dx%d and %dx%d\n", before.Width, before.Height, after.Width, after.Height);
+        return false;
+    }
+
+    const int points = SignatureSize / 3;
+    int bands = std::min<int>(Parallel::WorkerCount(), before.Height);
+
+    // RGB and weight sums per sample point, one set per band of rows
+    std::vector<double> band_sums(bands * points * 4, 0.0);
+
+    Parallel::For(bands, [&](int band)
+    {
+        double* sums = &band_sums[band * points * 4];
+        int32_t row_begin = before.Height * band / bands;
+        int32_t row_end = before.Height * (band + 1) / bands;
+
+        for (int32_t y = row_begin; y < row_end; ++y)
+        {
+            const uint8_t* before_row = before.Pixels + (size_t)y * before.Width * before.Comp;
+            const uint8_t* after_row = after.Pixels + (size_t)y * after.Width * after.Comp;
+
+            for (int32_t x = 0; x < before.Width; ++x)
+            {
+                const uint8_t* before_pixel = before_row + x * before.Comp;
+                const uint8_t* after_pixel = after_row + x * after.Comp;
+
+                // Grey pixels repeat their one channel
+                uint8_t before_rgb[3], after_rgb[3];
+
+                for (int c = 0; c < 3; ++c)
+                {
+                    before_rgb[c] = before_pixel[before.Comp < 3 ? 0 : c];
+                    after_rgb[c] = after_pixel[after.Comp < 3 ? 0 : c];
+                }
+
+                SplatPixel(before_rgb, after_rgb, sums);
+            }
+        }
+    });
+
+    double total_weight = (double)before.Width * before.Height;
+
+    for (int point = 0; point < points; ++point)
+    {
+        double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+        for (int band = 0; band < bands; ++band)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                sum[c] += band_sums[(band * points + point) * 4 + c];
+            }
+        }
+
+        float rgb[3] = { 0.0f, 0.0f, 0.0f };
+
+        if (sum[3] > 0.0)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                rgb[c] = (float)(sum[c] / sum[3] / 255.0);
+            }
+        }
+
+        Image::SRGBToLab(rgb, &signature[point * 3]);
+
+        for (int c = 0; c < 3; ++c)
+        {
+            weights[point * 3 + c] = (float)(sum[3] / total_weight);
+        }
+    }
+
+    return true;
+}
+
+int Find(const IndexDesc& index, const char* path)
+{
+    auto entry = std::find(index.Paths.begin(), index.Paths.end(), path);
+
+    return entry == index.Paths.end() ? -1 : (int)(entry - index.Paths.begin());
+}
+
+int Update(IndexDesc& index, const char* const* files, int count)
+{
+    TRACE_SCOPE("LookIndexUpdate");
+
+    IndexDesc updated;
+    updated.Paths.resize(count);
+    updated.FileSizes.resize(count);
+    updated.FileTimes.resize(count);
+    updated.Signatures.resize((size_t)count * SignatureSize);
+
+    std::vector<int> stale;
+
+    for (int i = 0; i < count; ++i)
+    {
+        struct stat file_stat;
+        bool exists = stat(files[i], &file_stat) == 0;
+
+        updated.Paths[i] = files[i];
+        updated.FileSizes[i] = exists ? file_stat.st_size : 0;
+        updated.FileTimes[i] = exists ? ModificationTime(file_stat) : 0;
+
+        int entry = Find(index, files[i]);
+
+        if (exists && entry >= 0 && index.FileSizes[entry] == updated.FileSizes[i] && index.FileTimes[entry] == updated.FileTimes[i])
+        {
+            std::copy_n(&index.Signatures[(size_t)entry * SignatureSize], SignatureSize, &updated.Signatures[(size_t)i * SignatureSize]);
+        }
+        else
+        {
+            stale.push_back(i);
+        }
+    }
+
+    std::vector<char> loaded(stale.size(), false);
+
+    Parallel::For((int)stale.size(), [&](int i)
+    {
+        Image::LUTDesc lut;
+
+        if (!Image::LoadLUT(files[stale[i]], lut)) return;
+
+        Signature(lut, &updated.Signatures[(size_t)stale[i] * SignatureSize]);
+        loaded[i] = true;
+    });
+
+    int taken = (int)std::count(loaded.begin(), loaded.end(), true);
+
+    // Files that failed to load are left out, and tried again by the next update
+    for (size_t i = stale.size(); i-- > 0;)
+    {
+        if (loaded[i]) continue;
+
+        int entry = stale[i];
+
+        fprintf(stderr, "Failed to index %s\n", files[entry]);
+
+        updated.Paths.erase(updated.Paths.begin() + entry);
+        updated.FileSizes.erase(updated.FileSizes.begin() + entry);
+        updated.FileTimes.erase(updated.FileTimes.begin() + entry);
+        updated.Signatures.erase(updated.Signatures.begin() + (size_t)entry * SignatureSize, updated.Signatures.begin() + (size_t)(entry + 1) * SignatureSize);
+    }
+
+    index = std::move(updated);
+
+    return taken;
+}
+
+template <typename T>
+static void Append(std::vector<char>& data, const T& value)
+{
+    const char* bytes = (const char*)&value;
+    data.insert(data.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+static bool Read(const std::vector<char>& data, size_t& offset, T& value)
+{
+    if (offset + sizeof(T) > data.size()) return false;
+
+    std::memcpy(&value, &data[offset], sizeof(T));
+    offset += sizeof(T);
+
+    return true;
+}
+
+bool Save(const char* path, const IndexDesc& index)
+{
+    std::vector<char> data(IndexMagic, IndexMagic + sizeof(IndexMagic));
+
+    Append(data, IndexVersion);
+    Append(data, (uint32_t)SignaturePoints);
+    Append(data, (uint32_t)index.Paths.size());
+
+    for (size_t i = 0; i < index.Paths.size(); ++i)
+    {
+        Append(data, (uint32_t)index.Paths[i].size());
+        data.insert(data.end(), index.Paths[i].begin(), index.Paths[i].end());
+        Append(data, index.FileSizes[i]);
+        Append(data, index.FileTimes[i]);
+    }
+
+    const char* signatures = (const char*)index.Signatures.data();
+    data.insert(data.end(), signatures, signatures + index.Signatures.size() * sizeof(float));
+
+    if (!Util::BytesToFile(path, data))
+    {
+        fprintf(stderr, "Failed to write look index %s\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool Load(const char* path, IndexDesc& index)
+{
+    std::vector<char> data = Util::BytesFromFile(path);
+
+    // A missing index is built from scratch
+    if (data.empty()) return false;
+
+    size_t offset = sizeof(IndexMagic);
+    uint32_t version = 0, points = 0, count = 0;
+
+    bool valid = data.size() >= sizeof(IndexMagic) && std::memcmp(data.data(), IndexMagic, sizeof(IndexMagic)) == 0
+        && Read(data, offset, version) && version == IndexVersion
+        && Read(data, offset, points) && points == SignaturePoints
+        && Read(data, offset, count);
+
+    IndexDesc loaded;
+
+    for (uint32_t i = 0; valid && i < count; ++i)
+    {
+        uint32_t length = 0;
+        uint64_t file_size = 0, file_time = 0;
+
+        valid = Read(data, offset, length) && offset + length <= data.size();
+
+        if (!valid) break;
+
+        loaded.Paths.emplace_back(&data[offset], length);
+        offset += length;
+
+        valid = Read(data, offset, file_size) && Read(data, offset, file_time);
+
+        loaded.FileSizes.push_back(file_size);
+        loaded.FileTimes.push_back(file_time);
+    }
+
+    size_t signature_bytes = (size_t)count * SignatureSize * sizeof(float);
+    valid = valid && data.size() - offset == signature_bytes;
+
+    if (!valid)
+    {
+        fprintf(stderr, "Ignoring invalid or outdated look index %s\n", path);
+        return false;
+    }
+
+    loaded.Signatures.resize((size_t)count * SignatureSize);
+    std::memcpy(loaded.Signatures.data(), &data[offset], signature_bytes);
+
+    index = std::move(loaded);
+
+    return true;
+}
+
+float Distance(const float* signature0, const float* signature1, const float* weights)
+{
+    // Four partial sums, so that the loop vectorizes without reassociating
+    float sums[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    float weight_sums[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    if (weights)
+    {
+        for (int i = 0; i < SignatureSize; i += 4)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                float delta = signature0[i + j] - signature1[i + j];
+                sums[j] += weights[i + j] * delta * delta;
+                weight_sums[j] += weights[i + j];
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0; i < SignatureSize; i += 4)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                float delta = signature0[i + j] - signature1[i + j];
+                sums[j] += delta * delta;
+                weight_sums[j] += 1.0f;
+            }
+        }
+    }
+
+    float sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    float weight_sum = (weight_sums[0] + weight_sums[1]) + (weight_sums[2] + weight_sums[3]);
+
+    // Each point contributes three weighted channels
+    return weight_sum > 0.0f ? std::sqrt(3.0f * sum / weight_sum) : 0.0f;
+}
+
+std::vector<Match> Nearest(const IndexDesc& index, const float* signature, const float* weights, int k, int exclude)
+{
+    TRACE_SCOPE("LookIndexNearest");
+
+    std::vector<Match> matches;
+    matches.reserve(index.Paths.size());
+
+    for (int i = 0; i < (int)index.Paths.size(); ++i)
+    {
+        if (i == exclude) continue;
+
+        matches.push_back({ i, Distance(signature, &index.Signatures[(size_t)i * SignatureSize], weights) });
+    }
+
+    k = std::max(0, std::min(k, (int)matches.size()));
+
+    std::partial_sort(matches.begin(), matches.begin() + k, matches.end(), [](const Match& a, const Match& b)
+    {
+        return a.Distance < b.Distance;
+    });
+
+    matches.resize(k);
+
+    return matches;
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Image.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace LookIndex
+{
+
+// Sample points per axis of a look signature
+static const int SignaturePoints = 8;
+
+// Floats per signature, the L*a*b* response at every sample point
+static const int SignatureSize = SignaturePoints * SignaturePoints * SignaturePoints * 3;
+
+// Signatures of a list of LUT files, stored back to back so that a query
+// streams through them
+struct IndexDesc
+{
+    std::vector<std::string> Paths;
+    // Size and modification time of each file when its signature was taken
+    std::vector<uint64_t> FileSizes;
+    std::vector<uint64_t> FileTimes;
+    std::vector<float> Signatures;
+};
+
+struct Match
+{
+    int Entry;
+    // Root mean square CIE76 difference over the signature points
+    float Distance;
+};
+
+// Samples the response of lut on the signature lattice
+void Signature(const Image::LUTDesc& lut, float* signature);
+
+// Signature of the look turning before into after, each point averaging the
+// after colours of the before colours around it. weights receives how much of
+// the image landed on each point, 0 where the pair says nothing about the look
+bool PairSignature(const Image::ImageData& before, const Image::ImageData& after, float* signature, float* weights);
+
+// Takes the signature of every file missing from index or changed on disk since
+// it was indexed, drops the entries of files no longer listed and returns the
+// number of signatures taken
+int Update(IndexDesc& index, const char* const* files, int count);
+
+bool Load(const char* path, IndexDesc& index);
+
+bool Save(const char* path, const IndexDesc& index);
+
+// Entry of path in index, -1 if absent
+int Find(const IndexDesc& index, const char* path);
+
+// Weighted distance between two signatures, weights may be null for equal ones
+float Distance(const float* signature0, const float* signature1, const float* weights);
+
+// The k entries closest to signature, nearest first, skipping exclude
+std::vector<Match> Nearest(const IndexDesc& index, const float* signature, const float* weights, int k, int exclude = -1);
+
+}
@@ -0,0 +1,274 @@
+#include "MicroBench.h"
+#include "ImageKernels.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace MicroBench
+{
+
+static const int InputCount = 4096;
+static const int Repetitions = 64;
+
+struct Distribution
+{
+    const char* Name;
+    std::vector<float> RGB;
+    std::vector<float> HSV;
+    std::vector<float> Extra;
+};
+
+struct MicroResult
+{
+    std::string Kernel;
+    std::string Distribution;
+    double Cycles;
+    double Nanoseconds;
+};
+
+// Reference cycles (TSC) on x86, the generic timer on ARM, nanoseconds elsewhere
+inline uint64_t ReadCycleCounter()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Keeps the compiler from discarding or hoisting kernel results
+template <typename T>
+inline void DoNotOptimize(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void ClobberMemory()
+{
+    asm volatile("" : : : "memory");
+}
+
+class Random
+{
+public:
+    Random(uint32_t seed) : m_State(seed) {}
+
+    float Next(float min, float max)
+    {
+        m_State = m_State * 1664525u + 1013904223u;
+        return min + (max - min) * ((m_State >> 8) / 16777216.0f);
+    }
+
+private:
+    uint32_t m_State;
+};
+
+std::vector<Distribution> GenerateDistributions()
+{
+    std::vector<Distribution> distributions(4);
+    Random random(0x5eed);
+
+    distributions[0].Name = "greys";
+    distributions[1].Name = "saturated";
+    distributions[2].Name = "uniform";
+    distributions[3].Name = "out_of_range";
+
+    for (auto& distribution : distributions)
+    {
+        std::string name(distribution.Name);
+
+        for (int i = 0; i < InputCount; ++i)
+        {
+            float rgb[3];
+
+            if (name == "greys")
+            {
+                rgb[0] = rgb[1] = rgb[2] = random.Next(0.0f, 1.0f);
+            }
+            else if (name == "saturated")
+            {
+                int channel = (int)random.Next(0.0f, 2.999f);
+                rgb[0] = rgb[1] = rgb[2] = 0.0f;
+                rgb[channel] = 1.0f;
+                rgb[(channel + 1) % 3] = random.Next(0.0f, 1.0f);
+            }
+            else if (name == "uniform")
+            {
+                for (float& c : rgb) c = random.Next(0.0f, 1.0f);
+            }
+            else
+            {
+                for (float& c : rgb) c = random.Next(-0.5f, 1.5f);
+            }
+
+            float hsv[3];
+            Image::RGB2HSV(rgb, hsv);
+
+            // HSV2RGB only accepts hues in [0, 360)
+            hsv[0] = std::fmod(hsv[0], 360.0f);
+
+            distribution.RGB.insert(distribution.RGB.end(), rgb, rgb + 3);
+            distribution.HSV.insert(distribution.HSV.end(), hsv, hsv + 3);
+
+            distribution.Extra.push_back(random.Next(0.0f, 1.0f));
+            distribution.Extra.push_back(random.Next(0.0f, 1.0f));
+            distribution.Extra.push_back(random.Next(0.0f, 1.0f));
+        }
+    }
+
+    return distributions;
+}
+
+// Best of several repetitions over the whole input set, the minimum is the
+// least disturbed by interrupts and frequency changes
+template <typename Kernel>
+MicroResult Measure(const char* kernel_name, const Distribution& distribution, Kernel kernel)
+{
+    using Clock = std::chrono::steady_clock;
+
+    MicroResult result;
+    result.Kernel = kernel_name;
+    result.Distribution = distribution.Name;
+    result.Cycles = 1e30;
+    result.Nanoseconds = 1e30;
+
+    for (int repetition = 0; repetition < Repetitions + 1; ++repetition)
+    {
+        auto start = Clock::now();
+        uint64_t start_cycles = ReadCycleCounter();
+
+        for (int i = 0; i < InputCount; ++i)
+        {
+            kernel(i);
+        }
+
+        ClobberMemory();
+
+        uint64_t cycles = ReadCycleCounter() - start_cycles;
+        double nanoseconds = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+        // The first pass only warms caches and the branch predictor
+        if (repetition == 0) continue;
+
+        result.Cycles = std::min(result.Cycles, (double)cycles / InputCount);
+        result.Nanoseconds = std::min(result.Nanoseconds, nanoseconds / InputCount);
+    }
+
+    printf("%-14s %-14s %12.2f %12.2f\n", kernel_name, distribution.Name, result.Cycles, result.Nanoseconds);
+
+    return result;
+}
+
+bool Run(const Image::LUTDesc& lut, const char* json_path)
+{
+    std::vector<Distribution> distributions = GenerateDistributions();
+    std::vector<MicroResult> results;
+
+    printf("%-14s %-14s %12s %12s\n", "kernel", "inputs", "cycles/call", "ns/call");
+
+    for (const auto& distribution : distributions)
+    {
+        const float* rgb = distribution.RGB.data();
+        const float* hsv = distribution.HSV.data();
+        const float* extra = distribution.Extra.data();
+
+        results.push_back(Measure("SRGB2Linear", distribution, [&](int i)
+        {
+            DoNotOptimize(Image::SRGB2Linear(rgb[i * 3]));
+        }));
+
+        results.push_back(Measure("Linear2SRGB", distribution, [&](int i)
+        {
+            DoNotOptimize(Image::Linear2SRGB(rgb[i * 3]));
+        }));
+
+        results.push_back(Measure("RGB2HSV", distribution, [&](int i)
+        {
+            float output[3];
+            Image::RGB2HSV(&rgb[i * 3], output);
+            DoNotOptimize(output);
+        }));
+
+        results.push_back(Measure("HSV2RGB", distribution, [&](int i)
+        {
+            float output[3];
+            Image::HSV2RGB(&hsv[i * 3], output);
+            DoNotOptimize(output);
+        }));
+
+        results.push_back(Measure("ApplyLUT", distribution, [&](int i)
+        {
+            float output[3];
+            Image::ApplyLUT(&rgb[i * 3], output, lut.Cube.data(), lut.Size);
+            DoNotOptimize(output);
+        }));
+
+        if (lut.Class == Image::LUTClassSeparable)
+        {
+            results.push_back(Measure("ApplyLUTSeparable", distribution, [&](int i)
+            {
+                float output[3];
+                Image::ApplyLUTSeparable(&rgb[i * 3], output, lut.Curves.data(), lut.Size);
+                DoNotOptimize(output);
+            }));
+        }
+
+        if (lut.Class == Image::LUTClassMonochrome)
+        {
+            results.push_back(Measure("ApplyLUTMono", distribution, [&](int i)
+            {
+                float output[3];
+                Image::ApplyLUTMonochrome(&rgb[i * 3], output, lut.Grey.data(), lut.Size);
+                DoNotOptimize(output);
+            }));
+        }
+
+        results.push_back(Measure("ApplyGrain", distribution, [&](int i)
+        {
+            float output[3];
+            float grain[3] = { extra[i * 3], extra[i * 3 + 1], extra[i * 3 + 2] };
+            Image::ApplyGrain(&rgb[i * 3], output, grain);
+            DoNotOptimize(output);
+        }));
+
+        results.push_back(Measure("ApplyVignette", distribution, [&](int i)
+        {
+            float output[3];
+            float uv[2] = { extra[i * 3], extra[i * 3 + 1] };
+            Image::ApplyVignette(&rgb[i * 3], output, uv);
+            DoNotOptimize(output);
+        }));
+    }
+
+    if (!json_path) return true;
+
+    FILE* file = fopen(json_path, "w");
+
+    if (!file) return false;
+
+    fprintf(file, "{\n  \"micro\": [\n");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        fprintf(file, "    {\"kernel\": \"%s\", \"inputs\": \"%s\", \"cycles_per_call\": %.3f, \"ns_per_call\": %.3f}%s\n",
+            results[i].Kernel.c_str(), results[i].Distribution.c_str(), results[i].Cycles, results[i].Nanoseconds,
+            i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+
+    return true;
+}
+
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Image.h"
+
+namespace MicroBench
+{
+
+// Times every colour kernel of ImageKernels.h over fixed pseudo-random inputs
+// drawn from several distributions, reporting cycles and nanoseconds per call
+bool Run(const Image::LUTDesc& lut, const char* json_path);
+
+}
@@ -0,0 +1,240 @@
+#include "Parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Parallel
+{
+
+static unsigned int s_WorkerCount = 0;
+
+unsigned int WorkerCount()
+{
+    if (s_WorkerCount > 0) return s_WorkerCount;
+
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void SetWorkerCount(unsigned int count)
+{
+    s_WorkerCount = count;
+}
+
+// Tasks of one For call, Pending counts those left to finish and Queued those
+// not taken yet
+struct TaskGroup
+{
+    std::atomic<int> Pending;
+    std::atomic<int> Queued;
+};
+
+// One index of a For call
+struct Task
+{
+    const std::function<void(int)>* Function;
+    int Index;
+    TaskGroup* Group;
+};
+
+// Deque of the pool thread running on this thread, 0 for threads outside the
+// pool, which share it
+static thread_local int s_Deque = 0;
+
+class Scheduler
+{
+public:
+    Scheduler(unsigned int worker_count)
+        : m_Queued(0)
+        , m_Stopping(false)
+    {
+        for (unsigned int i = 0; i < worker_count; ++i)
+        {
+            m_Deques.emplace_back(new TaskDeque());
+        }
+
+        for (unsigned int i = 1; i < worker_count; ++i)
+        {
+            m_Threads.emplace_back(&Scheduler::Work, this, (int)i);
+        }
+    }
+
+    ~Scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_WakeMutex);
+            m_Stopping = true;
+        }
+
+        m_Wake.notify_all();
+
+        for (auto& thread : m_Threads)
+        {
+            thread.join();
+        }
+    }
+
+    void For(int count, const std::function<void(int)>& task)
+    {
+        if (count <= 0) return;
+
+        // A single task, or no pool to share with, runs on the caller
+        if (count == 1 || m_Threads.empty())
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                task(i);
+            }
+
+            return;
+        }
+
+        TaskGroup group;
+        group.Pending = count;
+        group.Queued = count;
+        int deque = s_Deque;
+
+        // Counted before they are pushed so that the count never runs below the
+        // tasks still queued
+        m_Queued += count;
+
+        {
+            TaskDeque& tasks = *m_Deques[deque];
+            std::lock_guard<std::mutex> lock(tasks.Mutex);
+
+            // Pushed last to first, the owner pops from the back and runs them
+            // in order while thieves take the last indices
+            for (int i = count; i-- > 0;)
+            {
+                tasks.Tasks.push_back({ &task, i, &group });
+            }
+        }
+
+        Notify();
+
+        // Only tasks of this call are run while waiting, an unrelated one could
+        // keep the caller from returning long after its own tasks are done
+        while (group.Pending > 0)
+        {
+            Task next;
+
+            if (Take(deque, &group, next))
+            {
+                Run(next);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_WakeMutex);
+            m_Wake.wait(lock, [&]() { return group.Pending == 0 || group.Queued > 0; });
+        }
+    }
+
+private:
+    struct TaskDeque
+    {
+        std::mutex Mutex;
+        std::deque<Task> Tasks;
+    };
+
+    // Pops the newest task of deque, or steals the oldest of another one,
+    // only taking tasks of group unless it is null
+    bool Take(int deque, const TaskGroup* group, Task& task)
+    {
+        auto InGroup = [&](const Task& queued) { return !group || queued.Group == group; };
+
+        for (size_t i = 0; i < m_Deques.size(); ++i)
+        {
+            int victim = (int)((deque + i) % m_Deques.size());
+            TaskDeque& tasks = *m_Deques[victim];
+            std::lock_guard<std::mutex> lock(tasks.Mutex);
+
+            if (victim == deque)
+            {
+                auto next = std::find_if(tasks.Tasks.rbegin(), tasks.Tasks.rend(), InGroup);
+
+                if (next == tasks.Tasks.rend()) continue;
+
+                task = *next;
+                tasks.Tasks.erase(std::next(next).base());
+            }
+            else
+            {
+                auto next = std::find_if(tasks.Tasks.begin(), tasks.Tasks.end(), InGroup);
+
+                if (next == tasks.Tasks.end()) continue;
+
+                task = *next;
+                tasks.Tasks.erase(next);
+            }
+
+            --task.Group->Queued;
+            --m_Queued;
+            return true;
+        }
+
+        return false;
+    }
+
+    void Run(const Task& task)
+    {
+        (*task.Function)(task.Index);
+
+        // The waiting caller may return as soon as the count reaches zero, its
+        // task is not touched after
+        if (--task.Group->Pending == 0) Notify();
+    }
+
+    void Notify()
+    {
+        // Taking the lock orders the change with a waiter checking it
+        {
+            std::lock_guard<std::mutex> lock(m_WakeMutex);
+        }
+
+        m_Wake.notify_all();
+    }
+
+    void Work(int deque)
+    {
+        s_Deque = deque;
+
+        for (;;)
+        {
+            Task task;
+
+            if (Take(deque, nullptr, task))
+            {
+                Run(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_WakeMutex);
+            m_Wake.wait(lock, [&]() { return m_Stopping || m_Queued > 0; });
+
+            if (m_Stopping) return;
+        }
+    }
+
+    std::vector<std::unique_ptr<TaskDeque>> m_Deques;
+    std::vector<std::thread> m_Threads;
+    std::atomic<int> m_Queued;
+    std::mutex m_WakeMutex;
+    std::condition_variable m_Wake;
+    bool m_Stopping;
+};
+
+void For(int count, const std::function<void(int)>& task)
+{
+    // Started on first use, with one deque per worker and the calling threads
+    // working as the first
+    static Scheduler scheduler(WorkerCount());
+
+    scheduler.For(count, task);
+}
+
+}
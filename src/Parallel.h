@@ -0,0 +1,20 @@
+#pragma once
+
+#include <functional>
+
+namespace Parallel
+{
+
+unsigned int WorkerCount();
+
+// Overrides the hardware thread count, before the first For
+void SetWorkerCount(unsigned int count);
+
+// Runs task(0) .. task(count - 1) across the worker threads, the calling
+// thread included, and returns once every task has completed. Each worker
+// takes tasks from its own deque and steals from the others when it runs out,
+// and a caller waiting on its tasks runs those still queued meanwhile, so
+// nested calls spread over whichever workers are idle
+void For(int count, const std::function<void(int)>& task);
+
+}
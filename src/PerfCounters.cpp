@@ -0,0 +1,147 @@
+#include "PerfCounters.h"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace PerfCounters
+{
+
+static const char* CounterNames[CounterCount] = {
+    "cycles",
+    "instructions",
+    "l1d_misses",
+    "llc_misses",
+    "branch_misses",
+};
+
+CounterSample::CounterSample()
+{
+    memset(this, 0x0, sizeof(CounterSample));
+}
+
+const char* Name(Counter counter)
+{
+    return CounterNames[counter];
+}
+
+#ifdef __linux__
+
+static int s_Descriptors[CounterCount] = { -1, -1, -1, -1, -1 };
+
+static int OpenCounter(uint32_t type, uint64_t config)
+{
+    perf_event_attr attr;
+    memset(&attr, 0x0, sizeof(attr));
+
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // Counters are opened separately rather than as a group so that a missing
+    // one does not take the others down, the kernel may then multiplex them
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t CacheMissConfig(uint64_t cache)
+{
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+bool Open()
+{
+    s_Descriptors[CounterCycles] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    s_Descriptors[CounterInstructions] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    s_Descriptors[CounterL1Misses] = OpenCounter(PERF_TYPE_HW_CACHE, CacheMissConfig(PERF_COUNT_HW_CACHE_L1D));
+    s_Descriptors[CounterLLCMisses] = OpenCounter(PERF_TYPE_HW_CACHE, CacheMissConfig(PERF_COUNT_HW_CACHE_LL));
+    s_Descriptors[CounterBranchMisses] = OpenCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+    bool opened = false;
+
+    for (int i = 0; i < CounterCount; ++i)
+    {
+        if (s_Descriptors[i] >= 0)
+        {
+            opened = true;
+        }
+        else
+        {
+            fprintf(stderr, "Counter %s unavailable: %s\n", CounterNames[i], strerror(errno));
+        }
+    }
+
+    return opened;
+}
+
+void Close()
+{
+    for (int i = 0; i < CounterCount; ++i)
+    {
+        if (s_Descriptors[i] >= 0) close(s_Descriptors[i]);
+        s_Descriptors[i] = -1;
+    }
+}
+
+void Start()
+{
+    for (int i = 0; i < CounterCount; ++i)
+    {
+        if (s_Descriptors[i] < 0) continue;
+
+        ioctl(s_Descriptors[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(s_Descriptors[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void Stop(CounterSample& sample)
+{
+    for (int i = 0; i < CounterCount; ++i)
+    {
+        sample.Values[i] = 0.0;
+        sample.Available[i] = false;
+
+        if (s_Descriptors[i] < 0) continue;
+
+        ioctl(s_Descriptors[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        uint64_t values[3];
+
+        if (read(s_Descriptors[i], values, sizeof(values)) != sizeof(values) || values[2] == 0) continue;
+
+        // Scale up for the time the counter was multiplexed out
+        sample.Values[i] = (double)values[0] * values[1] / values[2];
+        sample.Available[i] = true;
+    }
+}
+
+#else
+
+bool Open()
+{
+    fprintf(stderr, "Hardware counters are only read on Linux\n");
+    return false;
+}
+
+void Close() {}
+void Start() {}
+
+void Stop(CounterSample& sample)
+{
+    sample = CounterSample();
+}
+
+#endif
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+namespace PerfCounters
+{
+
+enum Counter
+{
+    CounterCycles,
+    CounterInstructions,
+    CounterL1Misses,
+    CounterLLCMisses,
+    CounterBranchMisses,
+    CounterCount,
+};
+
+struct CounterSample
+{
+    CounterSample();
+
+    double Values[CounterCount];
+    bool Available[CounterCount];
+};
+
+// Opens the hardware counters for the calling process and the threads it
+// spawns afterwards. Returns false when none can be read, which is the case
+// outside Linux, under a restrictive perf_event_paranoid or without a PMU.
+bool Open();
+void Close();
+
+void Start();
+void Stop(CounterSample& sample);
+
+const char* Name(Counter counter);
+
+}
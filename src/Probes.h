@@ -0,0 +1,26 @@
+#pragma once
+
+// USDT probes at the pipeline stage boundaries, for tracing live processes
+// without rebuilding them, e.g.
+//
+//     bpftrace -e 'usdt:./dsip-cli:dsip:process_image_return { @[arg3] = count(); }'
+//
+// They compile to a single nop each when <sys/sdt.h> (systemtap-sdt-dev) is
+// found at build time, and to nothing otherwise.
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DSIP_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef DSIP_PROBES_ENABLED
+#define DSIP_PROBE1(_NAME, _A0) DTRACE_PROBE1(dsip, _NAME, _A0)
+#define DSIP_PROBE2(_NAME, _A0, _A1) DTRACE_PROBE2(dsip, _NAME, _A0, _A1)
+#define DSIP_PROBE4(_NAME, _A0, _A1, _A2, _A3) DTRACE_PROBE4(dsip, _NAME, _A0, _A1, _A2, _A3)
+#else
+#define DSIP_PROBE1(_NAME, _A0) ((void)0)
+#define DSIP_PROBE2(_NAME, _A0, _A1) ((void)0)
+#define DSIP_PROBE4(_NAME, _A0, _A1, _A2, _A3) ((void)0)
+#endif
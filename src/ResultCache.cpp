@@ -0,0 +1,180 @@
+#include "ResultCache.h"
+#include "Util.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+namespace ResultCache
+{
+
+static std::mutex s_EvictionMutex;
+
+// Bytes held by each cache directory, counted by a scan on the first store and
+// kept up to date by the later ones rather than rescanning for each
+static std::map<std::string, uint64_t> s_CacheSizes;
+
+struct CacheEntry
+{
+    std::string Path;
+    uint64_t Size;
+    uint64_t LastUse;
+};
+
+uint64_t ModificationTime(const struct stat& file_stat)
+{
+#ifdef __APPLE__
+    const timespec& time = file_stat.st_mtimespec;
+#else
+    const timespec& time = file_stat.st_mtim;
+#endif
+    return (uint64_t)time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+std::string EntryPath(const CacheDesc& cache, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".png", key);
+    return cache.Directory + "/" + name;
+}
+
+bool Initialize(const CacheDesc& cache)
+{
+    if (mkdir(cache.Directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Failed to create cache directory %s\n", cache.Directory.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Fetch(const CacheDesc& cache, uint64_t key, const char* output_path)
+{
+    std::string entry_path = EntryPath(cache, key);
+    auto data = Util::BytesFromFile(entry_path.c_str());
+
+    if (data.empty()) return false;
+
+    // Access time is unreliable (noatime mounts), the modification time
+    // doubles as the LRU timestamp
+    utime(entry_path.c_str(), nullptr);
+
+    return Util::BytesToFile(output_path, data);
+}
+
+// Lists the entries of the cache directory, returning their total size
+uint64_t ScanEntries(const CacheDesc& cache, std::vector<CacheEntry>& entries)
+{
+    DIR* directory = opendir(cache.Directory.c_str());
+
+    if (!directory) return 0;
+
+    uint64_t total_size = 0;
+
+    while (dirent* file = readdir(directory))
+    {
+        std::string name(file->d_name);
+
+        if (name.size() != 20 || name.compare(16, 4, ".png") != 0) continue;
+
+        CacheEntry entry;
+        entry.Path = cache.Directory + "/" + name;
+
+        struct stat entry_stat;
+        if (stat(entry.Path.c_str(), &entry_stat) != 0) continue;
+
+        entry.Size = entry_stat.st_size;
+        entry.LastUse = ModificationTime(entry_stat);
+        total_size += entry.Size;
+
+        entries.push_back(entry);
+    }
+
+    closedir(directory);
+
+    return total_size;
+}
+
+// Accounts for a stored entry of added bytes in place of one of removed bytes,
+// and evicts the least recently used entries once the total is over the limit
+void Evict(const CacheDesc& cache, uint64_t added, uint64_t removed)
+{
+    std::lock_guard<std::mutex> lock(s_EvictionMutex);
+
+    auto cache_size = s_CacheSizes.find(cache.Directory);
+
+    if (cache_size == s_CacheSizes.end())
+    {
+        std::vector<CacheEntry> entries;
+        cache_size = s_CacheSizes.emplace(cache.Directory, ScanEntries(cache, entries)).first;
+    }
+    else
+    {
+        cache_size->second += added;
+        cache_size->second -= std::min(cache_size->second, removed);
+    }
+
+    if (cache_size->second <= cache.MaxSize) return;
+
+    // Rescanned only to evict, which also picks up entries stored by other
+    // processes sharing the directory
+    std::vector<CacheEntry> entries;
+    uint64_t total_size = ScanEntries(cache, entries);
+
+    std::sort(entries.begin(), entries.end(), [](const CacheEntry& a, const CacheEntry& b)
+    {
+        return a.LastUse < b.LastUse;
+    });
+
+    for (const auto& entry : entries)
+    {
+        if (total_size <= cache.MaxSize) break;
+
+        if (unlink(entry.Path.c_str()) == 0)
+        {
+            total_size -= entry.Size;
+        }
+    }
+
+    cache_size->second = total_size;
+}
+
+bool Store(const CacheDesc& cache, uint64_t key, const char* output_path)
+{
+    auto data = Util::BytesFromFile(output_path);
+
+    if (data.empty() || data.size() > cache.MaxSize) return false;
+
+    std::string entry_path = EntryPath(cache, key);
+
+    // Written aside and renamed, concurrent readers never see a partial entry
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%d.%zu.tmp", (int)getpid(), std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::string temporary_path = entry_path + suffix;
+
+    // An entry already stored under key is replaced, its size no longer counts
+    struct stat entry_stat;
+    uint64_t replaced_size = stat(entry_path.c_str(), &entry_stat) == 0 ? entry_stat.st_size : 0;
+
+    if (!Util::BytesToFile(temporary_path.c_str(), data) || rename(temporary_path.c_str(), entry_path.c_str()) != 0)
+    {
+        unlink(temporary_path.c_str());
+        return false;
+    }
+
+    Evict(cache, data.size(), replaced_size);
+
+    return true;
+}
+
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace ResultCache
+{
+
+struct CacheDesc
+{
+    std::string Directory;
+    uint64_t MaxSize;
+};
+
+bool Initialize(const CacheDesc& cache);
+
+// Copies the cached result for key to output_path, refreshing its LRU position
+bool Fetch(const CacheDesc& cache, uint64_t key, const char* output_path);
+
+// Adds the file at output_path as the result for key, evicting the least
+// recently used results beyond the cache size
+bool Store(const CacheDesc& cache, uint64_t key, const char* output_path);
+
+}
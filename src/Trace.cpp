@@ -0,0 +1,95 @@
+#include "Trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Trace
+{
+
+std::atomic<bool> s_Enabled(false);
+
+struct Event
+{
+    const char* Name;
+    uint64_t Start;
+    uint64_t End;
+};
+
+struct ThreadEvents
+{
+    uint32_t ThreadID;
+    std::vector<Event> Events;
+};
+
+// Each thread appends to its own buffer, buffers outlive their threads so the
+// spans of finished workers are still written out
+static std::mutex s_Mutex;
+static std::vector<std::unique_ptr<ThreadEvents>> s_Threads;
+static thread_local ThreadEvents* s_ThreadEvents = nullptr;
+
+void Enable()
+{
+    Now();
+    s_Enabled = true;
+}
+
+uint64_t Now()
+{
+    using Clock = std::chrono::steady_clock;
+
+    static const Clock::time_point s_Origin = Clock::now();
+
+    // Zero is reserved for scopes opened while disabled
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - s_Origin).count() + 1;
+}
+
+void Record(const char* name, uint64_t start, uint64_t end)
+{
+    if (!s_ThreadEvents)
+    {
+        std::lock_guard<std::mutex> lock(s_Mutex);
+
+        s_Threads.emplace_back(new ThreadEvents());
+        s_ThreadEvents = s_Threads.back().get();
+        s_ThreadEvents->ThreadID = s_Threads.size();
+        s_ThreadEvents->Events.reserve(1024);
+    }
+
+    s_ThreadEvents->Events.push_back({ name, start, end });
+}
+
+bool Write(const char* path)
+{
+    s_Enabled = false;
+
+    FILE* file = fopen(path, "w");
+
+    if (!file) return false;
+
+    std::lock_guard<std::mutex> lock(s_Mutex);
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    const char* separator = "";
+
+    for (const auto& thread : s_Threads)
+    {
+        for (const Event& event : thread->Events)
+        {
+            fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}",
+                separator, event.Name, thread->ThreadID, event.Start * 1e-3, (event.End - event.Start) * 1e-3);
+            separator = ",\n";
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    return true;
+}
+
+}
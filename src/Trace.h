@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace Trace
+{
+
+extern std::atomic<bool> s_Enabled;
+
+// Starts recording spans, until then a scope costs a single relaxed load
+void Enable();
+
+// Writes the recorded spans as Chrome trace event JSON, to be opened with
+// chrome://tracing or ui.perfetto.dev
+bool Write(const char* path);
+
+// Nanoseconds since the first call, never zero
+uint64_t Now();
+
+void Record(const char* name, uint64_t start, uint64_t end);
+
+class Scope
+{
+public:
+    Scope(const char* name)
+        : m_Name(name)
+        , m_Start(s_Enabled.load(std::memory_order_relaxed) ? Now() : 0)
+    {
+    }
+
+    ~Scope()
+    {
+        if (m_Start) Record(m_Name, m_Start, Now());
+    }
+
+private:
+    const char* m_Name;
+    uint64_t m_Start;
+};
+
+}
+
+#define TRACE_CONCAT_IMPL(_A, _B) _A##_B
+#define TRACE_CONCAT(_A, _B) TRACE_CONCAT_IMPL(_A, _B)
+
+// Records the enclosing scope as a span, name must be a string literal
+#define TRACE_SCOPE(_NAME) Trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(_NAME)
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
 #ifdef DSIP_GUI
@@ -17,4 +19,8 @@ std::vector<char> BytesFromBundle(const char* file_path);
 
 std::vector<char> BytesFromFile(const char* file_path);
 
+bool BytesToFile(const char* file_path, const std::vector<char>& data);
+
+uint64_t Hash(const void* data, size_t size, uint64_t seed = 0);
+
 }
@@ -1,6 +1,7 @@
 #include "Util.h"
 #include "Window.h"
 
+#include <cstring>
 #include <fstream>
 
 #import <AppKit/AppKit.h>
@@ -135,4 +136,51 @@ std::vector<char> BytesFromFile(const char* file_path)
     return data;
 }
 
+bool BytesToFile(const char* file_path, const std::vector<char>& data)
+{
+    std::ofstream file(file_path, std::ofstream::binary);
+    if (!file.is_open()) return false;
+    file.write(data.data(), data.size());
+    return file.good();
+}
+
+uint64_t Hash(const void* data, size_t size, uint64_t seed)
+{
+    // MurmurHash64A
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t h = seed ^ (size * m);
+
+    for (size_t i = 0; i + 8 <= size; i += 8)
+    {
+        uint64_t k;
+        std::memcpy(&k, bytes + i, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    const uint8_t* tail = bytes + (size & ~size_t(7));
+    switch (size & 7)
+    {
+        case 7: h ^= uint64_t(tail[6]) << 48;
+        case 6: h ^= uint64_t(tail[5]) << 40;
+        case 5: h ^= uint64_t(tail[4]) << 32;
+        case 4: h ^= uint64_t(tail[3]) << 24;
+        case 3: h ^= uint64_t(tail[2]) << 16;
+        case 2: h ^= uint64_t(tail[1]) << 8;
+        case 1: h ^= uint64_t(tail[0]);
+                h *= m;
+    };
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
 }
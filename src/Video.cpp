@@ -0,0 +1,390 @@
+#include "Video.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+namespace Video
+{
+
+static const char Y4MMagic[] = "YUV4MPEG2";
+static const char FrameMagic[] = "FRAME";
+
+// Longest stream or frame header line accepted
+static const size_t MaxHeaderLength = 4096;
+
+StreamDesc::StreamDesc()
+    : Format(StreamFormatY4M)
+    , Width(0)
+    , Height(0)
+    , Chroma(ChromaFormat420)
+    , FullRange(false)
+{
+}
+
+bool ParseFormat(const char* name, StreamFormat& format)
+{
+    static const char* names[] = { "y4m", "rgb24", "rgba" };
+
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(*names)); ++i)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            format = (StreamFormat)i;
+            return true;
+        }
+    }
+
+    fprintf(stderr, "Unknown stream format %s, expected y4m, rgb24 or rgba\n", name);
+    return false;
+}
+
+// Reads up to the end of the line, false at the end of the file or on a line
+// too long to be a header
+static bool ReadLine(FILE* file, std::string& line)
+{
+    line.clear();
+
+    for (int c = fgetc(file); c != '\n'; c = fgetc(file))
+    {
+        if (c == EOF || line.size() >= MaxHeaderLength) return false;
+
+        line.push_back((char)c);
+    }
+
+    return true;
+}
+
+static bool ParseChroma(const std::string& name, ChromaFormat& chroma)
+{
+    // The 4:2:0 variants only differ in chroma siting
+    if (name == "420" || name == "420jpeg" || name == "420paldv" || name == "420mpeg2") chroma = ChromaFormat420;
+    else if (name == "422") chroma = ChromaFormat422;
+    else if (name == "444") chroma = ChromaFormat444;
+    else if (name == "mono") chroma = ChromaFormatMono;
+    else return false;
+
+    return true;
+}
+
+bool ReadHeader(FILE* file, StreamDesc& stream)
+{
+    if (stream.Format != StreamFormatY4M) return true;
+
+    std::string line;
+
+    if (!ReadLine(file, line) || line.compare(0, strlen(Y4MMagic), Y4MMagic) != 0)
+    {
+        fprintf(stderr, "Input is not a YUV4MPEG2 stream\n");
+        return false;
+    }
+
+    std::istringstream params(line.substr(strlen(Y4MMagic)));
+    std::string param;
+
+    while (params >> param)
+    {
+        std::string value = param.substr(1);
+
+        switch (param[0])
+        {
+        case 'W':
+            stream.Width = atoi(value.c_str());
+            break;
+        case 'H':
+            stream.Height = atoi(value.c_str());
+            break;
+        case 'C':
+            if (!ParseChroma(value, stream.Chroma))
+            {
+                fprintf(stderr, "Unsupported Y4M colour space %s, only 8-bit 4:2:0, 4:2:2, 4:4:4 and mono are\n", value.c_str());
+                return false;
+            }
+            break;
+        case 'X':
+            if (value == "COLORRANGE=FULL") stream.FullRange = true;
+            break;
+        }
+    }
+
+    if (stream.Width <= 0 || stream.Height <= 0)
+    {
+        fprintf(stderr, "Y4M stream header without a frame size\n");
+        return false;
+    }
+
+    stream.Header = line;
+
+    return true;
+}
+
+bool WriteHeader(FILE* file, const StreamDesc& stream)
+{
+    if (stream.Format != StreamFormatY4M) return true;
+
+    return fprintf(file, "%s\n", stream.Header.c_str()) > 0;
+}
+
+// Size of the chroma planes of a Y4M stream
+static void ChromaSize(const StreamDesc& stream, int32_t& width, int32_t& height)
+{
+    width = stream.Chroma == ChromaFormat444 ? stream.Width : (stream.Width + 1) / 2;
+    height = stream.Chroma == ChromaFormat420 ? (stream.Height + 1) / 2 : stream.Height;
+
+    if (stream.Chroma == ChromaFormatMono) width = height = 0;
+}
+
+size_t FrameSize(const StreamDesc& stream)
+{
+    size_t pixel_count = (size_t)stream.Width * stream.Height;
+
+    if (stream.Format != StreamFormatY4M) return pixel_count * FrameComp(stream);
+
+    int32_t chroma_width, chroma_height;
+    ChromaSize(stream, chroma_width, chroma_height);
+
+    return pixel_count + 2 * (size_t)chroma_width * chroma_height;
+}
+
+int32_t FrameComp(const StreamDesc& stream)
+{
+    return stream.Format == StreamFormatRGBA ? 4 : 3;
+}
+
+FrameStatus ReadFrame(FILE* file, const StreamDesc& stream, std::vector<uint8_t>& frame)
+{
+    int c = fgetc(file);
+
+    if (c == EOF)
+    {
+        if (!ferror(file)) return FrameStatusEnd;
+
+        fprintf(stderr, "Failed to read frame\n");
+        return FrameStatusError;
+    }
+
+    ungetc(c, file);
+
+    if (stream.Format == StreamFormatY4M)
+    {
+        std::string line;
+
+        if (!ReadLine(file, line) || line.compare(0, strlen(FrameMagic), FrameMagic) != 0)
+        {
+            fprintf(stderr, "Invalid Y4M frame header\n");
+            return FrameStatusError;
+        }
+    }
+
+    frame.resize(FrameSize(stream));
+
+    size_t read = fread(frame.data(), 1, frame.size(), file);
+
+    if (read != frame.size())
+    {
+        fprintf(stderr, "Truncated frame, %zu of %zu bytes\n", read, frame.size());
+        return FrameStatusError;
+    }
+
+    return FrameStatusRead;
+}
+
+bool WriteFrame(FILE* file, const StreamDesc& stream, const uint8_t* frame)
+{
+    if (stream.Format == StreamFormatY4M && fprintf(file, "%s\n", FrameMagic) < 0) return false;
+
+    size_t frame_size = FrameSize(stream);
+
+    return fwrite(frame, 1, frame_size, file) == frame_size;
+}
+
+// BT.601 luma weights
+static const float KR = 0.299f;
+static const float KB = 0.114f;
+static const float KG = 1.0f - KR - KB;
+
+// Fraction bits of the fixed point conversions
+static const int FixedShift = 16;
+static const float FixedOne = (float)(1 << FixedShift);
+static const int32_t FixedHalf = 1 << (FixedShift - 1);
+
+// Code value scales and luma offset of the stream's range, chroma is centered on 128
+static void RangeScales(const StreamDesc& stream, float& luma_scale, float& chroma_scale, float& luma_offset)
+{
+    luma_scale = stream.FullRange ? 255.0f : 219.0f;
+    chroma_scale = stream.FullRange ? 255.0f : 224.0f;
+    luma_offset = stream.FullRange ? 0.0f : 16.0f;
+}
+
+static inline int32_t ToFixed(float value)
+{
+    return (int32_t)std::lround(value * FixedOne);
+}
+
+static inline uint8_t FixedToCode(int32_t value)
+{
+    return (uint8_t)std::min(std::max((value + FixedHalf) >> FixedShift, 0), 255);
+}
+
+void ToRGB(const StreamDesc& stream, const uint8_t* frame, uint8_t* rgb)
+{
+    TRACE_SCOPE("ToRGB");
+
+    float luma_scale, chroma_scale, luma_offset;
+    RangeScales(stream, luma_scale, chroma_scale, luma_offset);
+
+    int32_t chroma_width, chroma_height;
+    ChromaSize(stream, chroma_width, chroma_height);
+
+    int x_shift = stream.Chroma == ChromaFormat444 ? 0 : 1;
+    int y_shift = stream.Chroma == ChromaFormat420 ? 1 : 0;
+
+    const uint8_t* luma = frame;
+    const uint8_t* cb = luma + (size_t)stream.Width * stream.Height;
+    const uint8_t* cr = cb + (size_t)chroma_width * chroma_height;
+
+    // Contribution of every code value to the RGB channels, in fixed point
+    int32_t luma_table[256], red_cr[256], green_cb[256], green_cr[256], blue_cb[256];
+
+    for (int code = 0; code < 256; ++code)
+    {
+        float y = (code - luma_offset) * 255.0f / luma_scale;
+        float c = (code - 128.0f) * 255.0f / chroma_scale;
+
+        luma_table[code] = ToFixed(y);
+        red_cr[code] = ToFixed(2.0f * (1.0f - KR) * c);
+        green_cb[code] = ToFixed(-2.0f * KB * (1.0f - KB) / KG * c);
+        green_cr[code] = ToFixed(-2.0f * KR * (1.0f - KR) / KG * c);
+        blue_cb[code] = ToFixed(2.0f * (1.0f - KB) * c);
+    }
+
+    for (int32_t i = 0; i < stream.Height; ++i)
+    {
+        const uint8_t* luma_row = luma + (size_t)i * stream.Width;
+        uint8_t* output = rgb + (size_t)i * stream.Width * 3;
+
+        if (stream.Chroma == ChromaFormatMono)
+        {
+            for (int32_t j = 0; j < stream.Width; ++j, output += 3)
+            {
+                output[0] = output[1] = output[2] = FixedToCode(luma_table[luma_row[j]]);
+            }
+
+            continue;
+        }
+
+        const uint8_t* cb_row = cb + (size_t)(i >> y_shift) * chroma_width;
+        const uint8_t* cr_row = cr + (size_t)(i >> y_shift) * chroma_width;
+
+        for (int32_t j = 0; j < stream.Width; ++j, output += 3)
+        {
+            int32_t y = luma_table[luma_row[j]];
+            int32_t u = cb_row[j >> x_shift];
+            int32_t v = cr_row[j >> x_shift];
+
+            output[0] = FixedToCode(y + red_cr[v]);
+            output[1] = FixedToCode(y + green_cb[u] + green_cr[v]);
+            output[2] = FixedToCode(y + blue_cb[u]);
+        }
+    }
+}
+
+void FromRGB(const StreamDesc& stream, const uint8_t* rgb, uint8_t* frame)
+{
+    TRACE_SCOPE("FromRGB");
+
+    float luma_scale, chroma_scale, luma_offset;
+    RangeScales(stream, luma_scale, chroma_scale, luma_offset);
+
+    int32_t chroma_width, chroma_height;
+    ChromaSize(stream, chroma_width, chroma_height);
+
+    int x_shift = stream.Chroma == ChromaFormat444 ? 0 : 1;
+    int y_shift = stream.Chroma == ChromaFormat420 ? 1 : 0;
+
+    uint8_t* luma = frame;
+    uint8_t* cb = luma + (size_t)stream.Width * stream.Height;
+    uint8_t* cr = cb + (size_t)chroma_width * chroma_height;
+
+    float luma_gain = luma_scale / 255.0f;
+    float cb_gain = chroma_scale / 255.0f / (2.0f * (1.0f - KB));
+    float cr_gain = chroma_scale / 255.0f / (2.0f * (1.0f - KR));
+
+    int32_t luma_weights[3] = { ToFixed(KR * luma_gain), ToFixed(KG * luma_gain), ToFixed(KB * luma_gain) };
+    int32_t luma_bias = ToFixed(luma_offset);
+
+    for (int32_t i = 0; i < stream.Height; ++i)
+    {
+        const uint8_t* input = rgb + (size_t)i * stream.Width * 3;
+        uint8_t* luma_row = luma + (size_t)i * stream.Width;
+
+        for (int32_t j = 0; j < stream.Width; ++j, input += 3)
+        {
+            luma_row[j] = FixedToCode(luma_bias + luma_weights[0] * input[0] + luma_weights[1] * input[1] + luma_weights[2] * input[2]);
+        }
+    }
+
+    if (stream.Chroma == ChromaFormatMono) return;
+
+    // Chroma of the mean colour of each block of pixels sharing a sample, the
+    // rows of a block are summed first
+    std::vector<int32_t> sums((size_t)chroma_width * 3);
+
+    for (int32_t i = 0; i < chroma_height; ++i)
+    {
+        int32_t row_begin = i << y_shift;
+        int32_t row_end = std::min(row_begin + (1 << y_shift), stream.Height);
+
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (int32_t y = row_begin; y < row_end; ++y)
+        {
+            const uint8_t* input = rgb + (size_t)y * stream.Width * 3;
+
+            for (int32_t j = 0; j < stream.Width; ++j, input += 3)
+            {
+                int32_t* sum = &sums[(j >> x_shift) * 3];
+                sum[0] += input[0];
+                sum[1] += input[1];
+                sum[2] += input[2];
+            }
+        }
+
+        // Odd sizes leave narrower blocks on the last column
+        int32_t rows = row_end - row_begin;
+        int32_t block_size = rows << x_shift;
+        int32_t last_block_size = rows * (stream.Width - ((chroma_width - 1) << x_shift));
+
+        // Weights of the r, g and b sums for Cb then Cr, for full and last blocks
+        int32_t weights[2][6];
+
+        for (int block = 0; block < 2; ++block)
+        {
+            float scale = 1.0f / (block ? last_block_size : block_size);
+
+            weights[block][0] = ToFixed(-KR * scale * cb_gain);
+            weights[block][1] = ToFixed(-KG * scale * cb_gain);
+            weights[block][2] = ToFixed((1.0f - KB) * scale * cb_gain);
+            weights[block][3] = ToFixed((1.0f - KR) * scale * cr_gain);
+            weights[block][4] = ToFixed(-KG * scale * cr_gain);
+            weights[block][5] = ToFixed(-KB * scale * cr_gain);
+        }
+
+        uint8_t* cb_row = cb + (size_t)i * chroma_width;
+        uint8_t* cr_row = cr + (size_t)i * chroma_width;
+
+        for (int32_t j = 0; j < chroma_width; ++j)
+        {
+            const int32_t* sum = &sums[j * 3];
+            const int32_t* weight = weights[j == chroma_width - 1];
+
+            cb_row[j] = FixedToCode((128 << FixedShift) + weight[0] * sum[0] + weight[1] * sum[1] + weight[2] * sum[2]);
+            cr_row[j] = FixedToCode((128 << FixedShift) + weight[3] * sum[0] + weight[4] * sum[1] + weight[5] * sum[2]);
+        }
+    }
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace Video
+{
+
+// Uncompressed frame streams, YUV4MPEG2 or headerless packed RGB as produced
+// and consumed by ffmpeg -f yuv4mpegpipe and -f rawvideo
+enum StreamFormat
+{
+    StreamFormatY4M,
+    StreamFormatRGB24,
+    StreamFormatRGBA,
+};
+
+// Chroma planes of a Y4M stream
+enum ChromaFormat
+{
+    ChromaFormat420,
+    ChromaFormat422,
+    ChromaFormat444,
+    ChromaFormatMono,
+};
+
+struct StreamDesc
+{
+    StreamDesc();
+    StreamFormat Format;
+    int32_t Width;
+    int32_t Height;
+    ChromaFormat Chroma;
+    // Y4M samples span 0-255 rather than the 16-235 video range
+    bool FullRange;
+    // Y4M stream header as read, written back unchanged
+    std::string Header;
+};
+
+// StreamFormat of y4m, rgb24 or rgba
+bool ParseFormat(const char* name, StreamFormat& format);
+
+// Reads the Y4M stream header, raw streams have none and take their size from
+// the caller
+bool ReadHeader(FILE* file, StreamDesc& stream);
+
+bool WriteHeader(FILE* file, const StreamDesc& stream);
+
+// Bytes of one frame, without the Y4M frame header
+size_t FrameSize(const StreamDesc& stream);
+
+// Channels of the RGB pixels of a frame, 4 for RGBA streams and 3 otherwise
+int32_t FrameComp(const StreamDesc& stream);
+
+enum FrameStatus
+{
+    FrameStatusRead,
+    // The stream ended cleanly, between two frames
+    FrameStatusEnd,
+    // A malformed or truncated frame, which is reported
+    FrameStatusError,
+};
+
+// Reads the next frame into frame
+FrameStatus ReadFrame(FILE* file, const StreamDesc& stream, std::vector<uint8_t>& frame);
+
+bool WriteFrame(FILE* file, const StreamDesc& stream, const uint8_t* frame);
+
+// BT.601 conversions between a Y4M frame and RGB pixels, chroma is upsampled by
+// repetition and downsampled by averaging
+void ToRGB(const StreamDesc& stream, const uint8_t* frame, uint8_t* rgb);
+
+void FromRGB(const StreamDesc& stream, const uint8_t* rgb, uint8_t* frame);
+
+}
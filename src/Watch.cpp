@@ -0,0 +1,318 @@
+#include "Watch.h"
+#include "Parallel.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace Watch
+{
+
+static std::atomic<bool> s_Running(false);
+
+// Files found and not yet processed, in the order they were found
+class FileBatch
+{
+public:
+    void Add(const std::string& path)
+    {
+        // A file can be reported by more than one event, or by a scan and an
+        // event
+        if (m_Queued.insert(path).second) m_Paths.push_back(path);
+    }
+
+    bool Take(std::string& path)
+    {
+        if (m_Paths.empty()) return false;
+
+        path = m_Paths.front();
+        m_Paths.pop_front();
+        m_Queued.erase(path);
+
+        return true;
+    }
+
+    bool Empty() const
+    {
+        return m_Paths.empty();
+    }
+
+private:
+    std::deque<std::string> m_Paths;
+    std::set<std::string> m_Queued;
+};
+
+bool IsInFlight(const std::string& name)
+{
+    auto EndsWith = [&](const char* suffix)
+    {
+        size_t length = strlen(suffix);
+        return name.size() >= length && name.compare(name.size() - length, length, suffix) == 0;
+    };
+
+    return name.empty() || name[0] == '.' || EndsWith(".part") || EndsWith(".tmp");
+}
+
+// Regular files only, in-flight writes are skipped
+bool StatFile(const std::string& path, const std::string& name, struct stat& file_stat)
+{
+    if (IsInFlight(name)) return false;
+
+    return stat(path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+}
+
+void EnqueueFile(FileBatch& batch, const std::string& directory, const std::string& name)
+{
+    std::string path = directory + "/" + name;
+
+    struct stat file_stat;
+    if (!StatFile(path, name, file_stat)) return;
+
+    batch.Add(path);
+}
+
+void ScanDirectory(FileBatch& batch, const std::string& directory)
+{
+    DIR* dir = opendir(directory.c_str());
+
+    if (!dir) return;
+
+    while (dirent* file = readdir(dir))
+    {
+        EnqueueFile(batch, directory, file->d_name);
+    }
+
+    closedir(dir);
+}
+
+// Size and modification time of each file seen by the last scan
+typedef std::map<std::string, std::pair<off_t, time_t>> FileStates;
+
+// Queues the files whose size and modification time are those of the last
+// scan, a file still being written is left for a later one
+void ScanSettled(FileBatch& batch, const std::string& directory, FileStates& files)
+{
+    DIR* dir = opendir(directory.c_str());
+
+    if (!dir) return;
+
+    FileStates seen;
+
+    while (dirent* file = readdir(dir))
+    {
+        std::string name(file->d_name);
+        std::string path = directory + "/" + name;
+
+        struct stat file_stat;
+        if (!StatFile(path, name, file_stat)) continue;
+
+        auto state = std::make_pair(file_stat.st_size, file_stat.st_mtime);
+        auto previous = files.find(path);
+
+        if (previous != files.end() && previous->second == state)
+        {
+            batch.Add(path);
+        }
+
+        seen[path] = state;
+    }
+
+    closedir(dir);
+
+    files.swap(seen);
+}
+
+// Queues the files left from an earlier scan once their size and modification
+// time stop changing, and forgets those that went away
+void SettleFiles(FileBatch& batch, FileStates& files)
+{
+    for (auto file = files.begin(); file != files.end(); )
+    {
+        struct stat file_stat;
+
+        if (stat(file->first.c_str(), &file_stat) != 0)
+        {
+            file = files.erase(file);
+            continue;
+        }
+
+        auto state = std::make_pair(file_stat.st_size, file_stat.st_mtime);
+
+        if (state == file->second)
+        {
+            batch.Add(file->first);
+            file = files.erase(file);
+            continue;
+        }
+
+        file->second = state;
+        ++file;
+    }
+}
+
+void MoveAside(const std::string& directory, const std::string& path, const char* subdirectory)
+{
+    std::string target_directory = directory + "/" + subdirectory;
+    std::string target = target_directory + path.substr(path.find_last_of('/'));
+
+    mkdir(target_directory.c_str(), 0755);
+
+    if (rename(path.c_str(), target.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to move %s to %s\n", path.c_str(), target.c_str());
+    }
+}
+
+// Takes up to one file per worker from the batch and processes them across the
+// Parallel workers, files not yet started when a stop comes are left for the
+// next run
+void ProcessChunk(const std::string& directory, FileBatch& batch, const FileCallback& callback)
+{
+    std::vector<std::string> paths;
+    std::string path;
+
+    while (paths.size() < Parallel::WorkerCount() && batch.Take(path))
+    {
+        paths.push_back(path);
+    }
+
+    Parallel::For((int)paths.size(), [&](int i)
+    {
+        if (!s_Running) return;
+
+        bool res = callback(paths[i]);
+        MoveAside(directory, paths[i], res ? "done" : "failed");
+    });
+}
+
+#ifdef __linux__
+// Queues the files reported by the pending inotify events
+void ReadEvents(int notify_fd, const std::string& directory, FileBatch& batch, FileStates& files)
+{
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+
+    while ((length = read(notify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char* event_data = buffer; event_data < buffer + length; )
+        {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(event_data);
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were dropped, rescan for the files they reported
+                ScanDirectory(batch, directory);
+            }
+            else if (event->len > 0)
+            {
+                files.erase(directory + "/" + event->name);
+                EnqueueFile(batch, directory, event->name);
+            }
+
+            event_data += sizeof(inotify_event) + event->len;
+        }
+    }
+}
+#endif
+
+void Stop(int)
+{
+    s_Running = false;
+}
+
+bool Run(const char* directory, const FileCallback& callback)
+{
+    std::string watch_directory(directory);
+    FileBatch batch;
+
+#ifdef __linux__
+    int notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    // Subscribe before the startup scan so nothing lands in between unseen
+    if (notify_fd < 0 || inotify_add_watch(notify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        fprintf(stderr, "Failed to watch %s: %s\n", directory, strerror(errno));
+        if (notify_fd >= 0) close(notify_fd);
+        return false;
+    }
+#else
+    struct stat directory_stat;
+    if (stat(directory, &directory_stat) != 0 || !S_ISDIR(directory_stat.st_mode))
+    {
+        fprintf(stderr, "Failed to watch %s\n", directory);
+        return false;
+    }
+#endif
+
+    s_Running = true;
+    signal(SIGINT, Stop);
+    signal(SIGTERM, Stop);
+
+    // Files already there may still be being written by a copy the restart
+    // interrupted, they are taken once they settle like rescanned ones, or on
+    // their close event
+    FileStates files;
+    ScanSettled(batch, watch_directory, files);
+
+    auto last_scan = std::chrono::steady_clock::now();
+
+    while (s_Running)
+    {
+        // A chunk at a time with the events read in between, files arriving
+        // during a large batch join it rather than wait for all of it
+        ProcessChunk(watch_directory, batch, callback);
+
+        // Waits for new files only once the batch is done
+        int timeout = batch.Empty() ? 500 : 0;
+
+#ifdef __linux__
+        pollfd poll_fd = { notify_fd, POLLIN, 0 };
+
+        if (poll(&poll_fd, 1, timeout) > 0)
+        {
+            ReadEvents(notify_fd, watch_directory, batch, files);
+        }
+#else
+        poll(nullptr, 0, timeout);
+#endif
+
+        // Files settle over two looks at least half a second apart
+        auto now = std::chrono::steady_clock::now();
+
+        if (now - last_scan < std::chrono::milliseconds(500)) continue;
+
+        last_scan = now;
+
+#ifdef __linux__
+        SettleFiles(batch, files);
+#else
+        // No inotify, fall back to rescanning the directory and taking the
+        // files that did not change since the last scan
+        ScanSettled(batch, watch_directory, files);
+#endif
+    }
+
+#ifdef __linux__
+    close(notify_fd);
+#endif
+
+    return true;
+}
+
+}
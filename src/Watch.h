@@ -0,0 +1,19 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+namespace Watch
+{
+
+// Returns whether the file was processed, failed files are set aside
+typedef std::function<bool(const std::string& path)> FileCallback;
+
+// Processes the files already in directory, then every file written or moved
+// into it, across the Parallel workers until SIGINT or SIGTERM. Handled files
+// are moved to the done/ or failed/ subdirectories so that a restart only
+// picks up what is left. Dot files and .part/.tmp names are treated as
+// in-flight writes and ignored
+bool Run(const char* directory, const FileCallback& callback);
+
+}
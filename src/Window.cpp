@@ -7,6 +7,7 @@
 #include "imgui_impl_glfw_gl3.cpp"
 
 #include "LUTs.h"
+#include "Trace.h"
 #include "Util.h"
 #include "FilmGrain.h"
 
@@ -26,6 +27,8 @@ Window::~Window()
 
 void Window::LoadImage(const std::string& path)
 {
+    TRACE_SCOPE("Window::LoadImage");
+
     Image::FreeImage(m_Image.Data);
 
     if (!Image::LoadImage(path.c_str(), m_Image.Data)) return;
@@ -46,13 +49,30 @@ void Window::LoadImage(const std::string& path)
 
     glfwSetWindowSize(m_Window, m_Width, m_Height);
 
-    GLuint format = m_Image.Data.Comp == 4 ? GL_RGBA : GL_RGB;
+    GLuint format = Image::OutputComp(m_Image.Data.Comp) == 4 ? GL_RGBA : GL_RGB;
 
     glGenTextures(1, &m_Image.TextureReference);
     glBindTexture(GL_TEXTURE_2D, m_Image.TextureReference);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, m_Image.Data.Width, m_Image.Data.Height, 0, format, GL_UNSIGNED_BYTE, m_Image.Data.Pixels);
+
+    if (m_Image.Data.Comp < 3)
+    {
+        // The shader samples the reference as RGB, grey sources are expanded once
+        size_t pixel_count = (size_t)m_Image.Data.Width * m_Image.Data.Height;
+        std::vector<uint8_t> reference(pixel_count * 3);
+
+        for (size_t i = 0; i < pixel_count; ++i)
+        {
+            reference[i * 3 + 0] = reference[i * 3 + 1] = reference[i * 3 + 2] = m_Image.Data.Pixels[i * m_Image.Data.Comp];
+        }
+
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, m_Image.Data.Width, m_Image.Data.Height, 0, GL_RGB, GL_UNSIGNED_BYTE, reference.data());
+    }
+    else
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, m_Image.Data.Width, m_Image.Data.Height, 0, format, GL_UNSIGNED_BYTE, m_Image.Data.Pixels);
+    }
 
     glGenTextures(1, &m_Image.Texture);
     glBindTexture(GL_TEXTURE_2D, m_Image.Texture);
@@ -84,7 +104,13 @@ void Window::LoadImage(const std::string& path)
 
 void Window::SaveImage(const std::string& path)
 {
-    Image::ImageDesc image = m_Image;
+    TRACE_SCOPE("Window::SaveImage");
+
+    // The decoded pixels are shared, the save renders into its own scratch buffer
+    Image::ImageDesc image;
+    image.Path = m_Image.Path;
+    image.Data = m_Image.Data;
+
     Image::ProcessParams process_params = m_ProcessParams;
     process_params.CPUPipeline = true;
 
@@ -276,7 +302,7 @@ void Window::Show()
             m_FilterLUT = m_LastFilterLUT;
             m_ProcessParams.LUTFile = LUTs[m_FilterLUT];
             ProcessImage(m_Image, m_ProcessParams);
-            GLuint format = m_Image.Data.Comp == 4 ? GL_RGBA : GL_RGB;
+            GLuint format = Image::OutputComp(m_Image.Data.Comp) == 4 ? GL_RGBA : GL_RGB;
             glBindTexture(GL_TEXTURE_2D, m_Image.Texture);
             glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, m_Image.Data.Width, m_Image.Data.Height, 0, format, GL_UNSIGNED_BYTE, m_Image.ScratchData);
         }
@@ -1,8 +1,30 @@
 #ifdef DSIP_GUI
 #include "Window.h"
 #endif
+#include "ContactSheet.h"
 #include "FilmGrain.h"
 #include "Image.h"
+#include "LookFit.h"
+#include "LookIndex.h"
+#include "LUTs.h"
+#include "Parallel.h"
+#include "ResultCache.h"
+#include "Trace.h"
+#include "Util.h"
+#include "Video.h"
+#include "Watch.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 extern "C"
 {
@@ -11,69 +33,1019 @@ extern "C"
 
 #define ARRAYSIZE(_ARR) ((int)(sizeof(_ARR) / sizeof(*_ARR)))
 
+#define DSIP_VERSION "0.1.0"
+
 struct CLIOptions
 {
     const char* ImageInput;
     const char* ImageProfile;
     const char* ImageOutput;
+    const char* ProfileList;
+    const char* RenditionSizes;
+    const char* ContactSheet;
+    int ThumbnailSize;
+    const char* CacheDirectory;
+    int CacheSize;
+    int Seed;
+    const char* Watch;
+    const char* Trace;
+    const char* Precision;
+    bool Memoize;
+    bool Greyscale;
+    const char* LUTBudget;
+    const char* LookIndex;
+    int Similar;
+    const char* MatchLook;
+    int Top;
+    const char* FitLook;
+    const char* FitLUT;
+    const char* FitProfile;
+    int FitLevel;
+    const char* Sequence;
+    int FrameStart;
+    int FrameCount;
+    const char* Filter;
+    const char* FrameSize;
+};
+
+struct ProcessJob
+{
+    std::string Profile;
+    std::string Output;
+    Image::ProcessParams Params;
 };
 
 bool ValidateOptions(CLIOptions options)
 {
-    return options.ImageInput && options.ImageOutput && options.ImageProfile;
+    return options.ImageInput && ((options.ImageOutput && options.ImageProfile) || options.ProfileList);
+}
+
+std::vector<std::string> SplitList(const char* list, char separator)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+
+    while (std::getline(stream, item, separator))
+    {
+        if (!item.empty()) items.push_back(item);
+    }
+
+    return items;
+}
+
+bool ReadProfileList(const char* path, std::vector<ProcessJob>& jobs)
+{
+    std::ifstream file_list(path, std::ios::in);
+
+    if (!file_list.is_open()) return false;
+
+    std::string line;
+
+    while (std::getline(file_list, line))
+    {
+        if (line.empty() || line[0] == '#') continue;
+
+        ProcessJob job;
+        std::stringstream line_stream(line);
+
+        if (!(line_stream >> job.Profile >> job.Output)) return false;
+
+        jobs.push_back(job);
+    }
+
+    return true;
+}
+
+bool LoadJobProfiles(std::vector<ProcessJob>& jobs, CLIOptions options)
+{
+    int grain_index = Image::GrainIndexFromSeed(options.Seed);
+
+    Image::ProcessPrecision precision = Image::ProcessPrecisionExact;
+    Image::ParsePrecision(options.Precision, precision);
+
+    for (auto& job : jobs)
+    {
+        if (!Image::LoadProfile(job.Profile.c_str(), job.Params))
+        {
+            fprintf(stderr, "Failed to load profile %s\n", job.Profile.c_str());
+            return false;
+        }
+
+        job.Params.CPUPipeline = true;
+        job.Params.GrainFile = FilmGrain[grain_index];
+        job.Params.GrainIndex = grain_index;
+        job.Params.Precision = precision;
+        job.Params.Memoize = options.Memoize;
+    }
+
+    return !jobs.empty();
+}
+
+bool CollectJobs(CLIOptions options, std::vector<ProcessJob>& jobs)
+{
+    if (options.ProfileList && !ReadProfileList(options.ProfileList, jobs))
+    {
+        fprintf(stderr, "Failed to read profile list %s\n", options.ProfileList);
+        return false;
+    }
+
+    if (options.ImageProfile && options.ImageOutput)
+    {
+        auto profiles = SplitList(options.ImageProfile, ',');
+        auto outputs = SplitList(options.ImageOutput, ',');
+
+        if (profiles.size() != outputs.size())
+        {
+            fprintf(stderr, "Got %d profiles for %d outputs\n", (int)profiles.size(), (int)outputs.size());
+            return false;
+        }
+
+        for (size_t i = 0; i < profiles.size(); ++i)
+        {
+            ProcessJob job;
+            job.Profile = profiles[i];
+            job.Output = outputs[i];
+            jobs.push_back(job);
+        }
+    }
+
+    return LoadJobProfiles(jobs, options);
+}
+
+std::string FileName(const std::string& path)
+{
+    size_t separator = path.find_last_of('/');
+
+    return separator == std::string::npos ? path : path.substr(separator + 1);
+}
+
+std::string FileStem(const std::string& path)
+{
+    std::string name = FileName(path);
+
+    return name.substr(0, name.find_last_of('.'));
+}
+
+std::string RenditionPath(const std::string& output, int size)
+{
+    size_t extension = output.find_last_of('.');
+    size_t separator = output.find_last_of('/');
+
+    if (extension == std::string::npos || (separator != std::string::npos && extension < separator))
+    {
+        extension = output.size();
+    }
+
+    return output.substr(0, extension) + "-" + std::to_string(size) + output.substr(extension);
+}
+
+bool SaveRenditions(const Image::ImageDesc& image, const std::string& output, const std::vector<int>& sizes, bool greyscale)
+{
+    std::vector<char> results(sizes.size() + 1, false);
+
+    // Every rendition is filtered from the graded buffer, the full size output
+    // and the smaller ones encode concurrently
+    Parallel::For(results.size(), [&](int index)
+    {
+        if (index == 0)
+        {
+            results[index] = Image::SaveImage(output.c_str(), image, greyscale);
+            return;
+        }
+
+        int size = sizes[index - 1];
+
+        Image::ImageDesc rendition;
+        Image::DownscaleImage(image, rendition, size);
+
+        results[index] = Image::SaveImage(RenditionPath(output, size).c_str(), rendition, greyscale);
+    });
+
+    return std::find(results.begin(), results.end(), false) == results.end();
+}
+
+uint64_t JobKey(uint64_t input_hash, const ProcessJob& job, int seed, bool greyscale, float lut_budget)
+{
+    std::string description = Image::SerializeProfile(job.Params);
+
+    // Assets are keyed by their contents, so that replacing a LUT or grain
+    // file under the same name does not serve results graded with the old one
+    description += "lut:" + std::to_string(Image::LUTContentHash(job.Params.LUTFile)) + "\n";
+
+    for (const Image::ChainedLUT& chained : job.Params.LUTChain)
+    {
+        description += "lut_chain:" + std::to_string(Image::LUTContentHash(LUTs[chained.LUTIndex])) + "\n";
+    }
+
+    description += "grain:" + std::to_string(Image::GrainContentHash(job.Params.GrainFile)) + "\n";
+    description += "seed:" + std::to_string(seed) + "\n";
+
+    // Exact keys are left as they were so that existing cache entries stay valid
+    if (job.Params.Precision != Image::ProcessPrecisionExact)
+    {
+        description += std::string("precision:") + Image::PrecisionName(job.Params.Precision) + "\n";
+    }
+
+    if (greyscale)
+    {
+        description += "greyscale:1\n";
+    }
+
+    if (lut_budget > 0.0f)
+    {
+        description += "lut_budget:" + std::to_string(lut_budget) + "\n";
+    }
+
+    description += "version:" DSIP_VERSION "\n";
+
+    return Util::Hash(description.data(), description.size(), input_hash);
+}
+
+uint64_t RenditionKey(uint64_t job_key, int size)
+{
+    return Util::Hash(&size, sizeof(size), job_key);
+}
+
+bool FetchRenditions(const ResultCache::CacheDesc& cache, uint64_t job_key, const std::string& output, const std::vector<int>& sizes)
+{
+    if (!ResultCache::Fetch(cache, RenditionKey(job_key, 0), output.c_str())) return false;
+
+    for (int size : sizes)
+    {
+        if (!ResultCache::Fetch(cache, RenditionKey(job_key, size), RenditionPath(output, size).c_str())) return false;
+    }
+
+    return true;
+}
+
+void StoreRenditions(const ResultCache::CacheDesc& cache, uint64_t job_key, const std::string& output, const std::vector<int>& sizes)
+{
+    ResultCache::Store(cache, RenditionKey(job_key, 0), output.c_str());
+
+    for (int size : sizes)
+    {
+        ResultCache::Store(cache, RenditionKey(job_key, size), RenditionPath(output, size).c_str());
+    }
+}
+
+struct BatchDesc
+{
+    std::vector<int> RenditionSizes;
+    ResultCache::CacheDesc Cache;
+    bool UseCache;
+    int Seed;
+    bool Greyscale;
+    float LUTBudget;
+};
+
+void InitializeBatch(CLIOptions options, BatchDesc& batch)
+{
+    if (options.RenditionSizes)
+    {
+        for (const auto& size : SplitList(options.RenditionSizes, ','))
+        {
+            batch.RenditionSizes.push_back(std::max(1, atoi(size.c_str())));
+        }
+    }
+
+    batch.Cache.Directory = options.CacheDirectory ? options.CacheDirectory : "";
+    batch.Cache.MaxSize = (uint64_t)std::max(0, options.CacheSize) << 20;
+    batch.UseCache = options.CacheDirectory && ResultCache::Initialize(batch.Cache);
+    batch.Seed = options.Seed;
+    batch.Greyscale = options.Greyscale;
+    batch.LUTBudget = options.LUTBudget ? (float)atof(options.LUTBudget) : 0.0f;
+}
+
+bool ProcessInput(const char* input, const std::vector<ProcessJob>& jobs, const BatchDesc& batch)
+{
+    std::vector<char> input_data;
+
+    {
+        TRACE_SCOPE("ReadFile");
+        input_data = Util::BytesFromFile(input);
+    }
+
+    if (input_data.empty())
+    {
+        fprintf(stderr, "Failed to read %s\n", input);
+        return false;
+    }
+
+    uint64_t input_hash = batch.UseCache ? Util::Hash(input_data.data(), input_data.size()) : 0;
+
+    std::vector<char> job_results(jobs.size(), false);
+    std::vector<int> pending_jobs;
+
+    for (int i = 0; i < (int)jobs.size(); ++i)
+    {
+        if (batch.UseCache && FetchRenditions(batch.Cache, JobKey(input_hash, jobs[i], batch.Seed, batch.Greyscale, batch.LUTBudget), jobs[i].Output, batch.RenditionSizes))
+        {
+            job_results[i] = true;
+            continue;
+        }
+
+        pending_jobs.push_back(i);
+    }
+
+    if (!pending_jobs.empty())
+    {
+        Image::ImageData image_data;
+
+        if (!Image::DecodeImage(input_data, image_data))
+        {
+            fprintf(stderr, "Failed to decode %s\n", input);
+            return false;
+        }
+
+        // The decoded source is shared read-only, each job owns its scratch output
+        Parallel::For(pending_jobs.size(), [&](int pending_index)
+        {
+            TRACE_SCOPE("Job");
+
+            int job_index = pending_jobs[pending_index];
+            const ProcessJob& job = jobs[job_index];
+
+            Image::ImageDesc image;
+            image.Data = image_data;
+
+            if (!Image::ProcessImage(image, job.Params))
+            {
+                fprintf(stderr, "Failed to process %s for %s, with LUT %s and grain %s\n", input, job.Output.c_str(), job.Params.LUTFile, job.Params.GrainFile);
+                return;
+            }
+
+            bool res = SaveRenditions(image, job.Output, batch.RenditionSizes, batch.Greyscale);
+
+            if (res && batch.UseCache)
+            {
+                StoreRenditions(batch.Cache, JobKey(input_hash, job, batch.Seed, batch.Greyscale, batch.LUTBudget), job.Output, batch.RenditionSizes);
+            }
+
+            job_results[job_index] = res;
+        });
+
+        Image::FreeImage(image_data);
+    }
+
+    return std::find(job_results.begin(), job_results.end(), false) == job_results.end();
 }
 
 int Process(CLIOptions options)
 {
-    Image::ImageDesc image;
+    TRACE_SCOPE("Process");
+
+    std::vector<ProcessJob> jobs;
+
+    if (!CollectJobs(options, jobs)) return EXIT_FAILURE;
+
+    BatchDesc batch;
+    InitializeBatch(options, batch);
+
+    return ProcessInput(options.ImageInput, jobs, batch) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Path of a frame from a printf style pattern with one integer conversion,
+// such as shot-%04d.png
+bool FramePath(const char* pattern, int frame, std::string& path)
+{
+    const char* conversion = strchr(pattern, '%');
+    const char* type = conversion ? conversion + 1 : nullptr;
+
+    while (type && isdigit((unsigned char)*type)) ++type;
+
+    if (!type || *type != 'd' || strchr(type, '%'))
+    {
+        fprintf(stderr, "Frame pattern %s needs one integer conversion, such as %%04d\n", pattern);
+        return false;
+    }
+
+    char frame_path[4096];
+    snprintf(frame_path, sizeof(frame_path), pattern, frame);
+    path = frame_path;
+
+    return true;
+}
+
+// Processes the numbered frames of options.Sequence into the --output pattern,
+// several frames at a time, with the grain animating from frame to frame
+int ProcessSequence(CLIOptions options)
+{
+    TRACE_SCOPE("Sequence");
+
+    std::string path;
+
+    if (!options.ImageProfile || !options.ImageOutput)
+    {
+        fprintf(stderr, "--sequence needs --profile and an --output frame pattern\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!FramePath(options.Sequence, 0, path) || !FramePath(options.ImageOutput, 0, path)) return EXIT_FAILURE;
+
+    std::vector<ProcessJob> jobs(1);
+    jobs[0].Profile = options.ImageProfile;
+
+    if (!LoadJobProfiles(jobs, options)) return EXIT_FAILURE;
+
+    // Without a frame count the sequence runs until the first missing frame
+    std::vector<int> frames;
+    int frame_end = options.FrameCount > 0 ? options.FrameStart + options.FrameCount : INT_MAX;
+
+    for (int frame = options.FrameStart; frame < frame_end; ++frame)
+    {
+        struct stat frame_stat;
+        FramePath(options.Sequence, frame, path);
+
+        if (stat(path.c_str(), &frame_stat) == 0)
+        {
+            frames.push_back(frame);
+        }
+        else if (options.FrameCount > 0)
+        {
+            fprintf(stderr, "Missing frame %s\n", path.c_str());
+            return EXIT_FAILURE;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (frames.empty())
+    {
+        fprintf(stderr, "No frame %d for %s\n", options.FrameStart, options.Sequence);
+        return EXIT_FAILURE;
+    }
+
+    // The look is held for the whole sequence, each frame acquires its grain
+    // frame from the asset cache shared with the frames in flight, which keeps
+    // every grain frame the sequence cycles through decoded
+    Image::SetGrainCacheCapacity(std::max<size_t>(8, std::min<size_t>(frames.size(), ARRAYSIZE(FilmGrain))));
+
+    const Image::ProcessParams& process_params = jobs[0].Params;
+    auto lut = Image::AcquireLUT(process_params);
+
+    if (!lut)
+    {
+        fprintf(stderr, "Failed to load the LUT %s\n", process_params.LUTFile);
+        return EXIT_FAILURE;
+    }
+
+    BatchDesc batch;
+    InitializeBatch(options, batch);
+
+    std::vector<char> results(frames.size(), false);
+    auto start = std::chrono::steady_clock::now();
+
+    Parallel::For(frames.size(), [&](int index)
+    {
+        TRACE_SCOPE("Frame");
+
+        std::string input, output;
+        FramePath(options.Sequence, frames[index], input);
+        FramePath(options.ImageOutput, frames[index], output);
+
+        Image::ProcessParams frame_params = process_params;
+        frame_params.GrainIndex = Image::GrainIndexForFrame(options.Seed, frames[index]);
+        frame_params.GrainFile = FilmGrain[frame_params.GrainIndex];
+
+        auto grain = Image::AcquireGrain(frame_params.GrainFile);
+        Image::ImageDesc image;
+
+        if (!grain)
+        {
+            fprintf(stderr, "Failed to load the grain of frame %d, %s\n", frames[index], frame_params.GrainFile);
+            return;
+        }
+
+        if (!Image::LoadImage(input.c_str(), image.Data))
+        {
+            fprintf(stderr, "Failed to load frame %s\n", input.c_str());
+            return;
+        }
+
+        Image::ProcessImage(image, frame_params, *lut, *grain);
+
+        results[index] = SaveRenditions(image, output, batch.RenditionSizes, batch.Greyscale);
+
+        Image::FreeImage(image.Data);
+    });
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int processed = (int)std::count(results.begin(), results.end(), true);
+
+    printf("%d frames in %.2f s, %.2f fps\n", processed, elapsed, processed / elapsed);
+
+    return processed == (int)frames.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// A frame in flight through FilterVideo, the buffers are reused by the frames
+// that follow
+struct FilterSlot
+{
+    std::vector<uint8_t> Frame;
+    // RGB pixels of Y4M frames, raw frames are processed in place
+    std::vector<uint8_t> Pixels;
+    Image::ImageDesc Image;
+};
+
+// Grades the uncompressed frames read from stdin and writes them to stdout in
+// the same format, a frame per worker at a time
+int FilterVideo(CLIOptions options)
+{
+    TRACE_SCOPE("Filter");
+
+    Video::StreamDesc stream;
+
+    if (!Video::ParseFormat(options.Filter, stream.Format)) return EXIT_FAILURE;
+
+    if (stream.Format != Video::StreamFormatY4M
+        && (!options.FrameSize || sscanf(options.FrameSize, "%dx%d", &stream.Width, &stream.Height) != 2 || stream.Width <= 0 || stream.Height <= 0))
+    {
+        fprintf(stderr, "Raw video needs --frame-size, such as 1920x1080\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!options.ImageProfile)
+    {
+        fprintf(stderr, "--filter needs a --profile\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<ProcessJob> jobs(1);
+    jobs[0].Profile = options.ImageProfile;
+
+    if (!LoadJobProfiles(jobs, options)) return EXIT_FAILURE;
+
+    const Image::ProcessParams& process_params = jobs[0].Params;
+    auto lut = Image::AcquireLUT(process_params);
+
+    if (!lut || !Video::ReadHeader(stdin, stream) || !Video::WriteHeader(stdout, stream)) return EXIT_FAILURE;
+
+    // Streams run for any number of frames and cycle through every grain frame,
+    // all of them stay decoded
+    Image::SetGrainCacheCapacity(ARRAYSIZE(FilmGrain));
+
+    std::vector<FilterSlot> slots(Parallel::WorkerCount());
+
+    for (auto& slot : slots)
+    {
+        slot.Image.Data.Width = stream.Width;
+        slot.Image.Data.Height = stream.Height;
+        slot.Image.Data.Comp = Video::FrameComp(stream);
+    }
+
+    int frame_count = 0;
+    bool res = true;
+    auto start = std::chrono::steady_clock::now();
+
+    for (;;)
+    {
+        int slot_count = 0;
+        bool end = false;
+
+        while (slot_count < (int)slots.size() && !end)
+        {
+            Video::FrameStatus status = Video::ReadFrame(stdin, stream, slots[slot_count].Frame);
+
+            if (status == Video::FrameStatusRead)
+            {
+                ++slot_count;
+            }
+            else
+            {
+                // Frames read before a malformed one are still written
+                res = status == Video::FrameStatusEnd;
+                end = true;
+            }
+        }
+
+        std::vector<char> graded(slot_count, false);
+
+        Parallel::For(slot_count, [&](int index)
+        {
+            TRACE_SCOPE("Frame");
+
+            FilterSlot& slot = slots[index];
+
+            Image::ProcessParams frame_params = process_params;
+            frame_params.GrainIndex = Image::GrainIndexForFrame(options.Seed, frame_count + index);
+            frame_params.GrainFile = FilmGrain[frame_params.GrainIndex];
+
+            auto grain = Image::AcquireGrain(frame_params.GrainFile);
+
+            if (!grain) return;
+
+            if (stream.Format == Video::StreamFormatY4M)
+            {
+                slot.Pixels.resize((size_t)stream.Width * stream.Height * 3);
+                Video::ToRGB(stream, slot.Frame.data(), slot.Pixels.data());
+                slot.Image.Data.Pixels = slot.Pixels.data();
+            }
+            else
+            {
+                slot.Image.Data.Pixels = slot.Frame.data();
+            }
+
+            Image::ProcessImage(slot.Image, frame_params, *lut, *grain);
+
+            if (stream.Format == Video::StreamFormatY4M)
+            {
+                Video::FromRGB(stream, slot.Image.ScratchData, slot.Frame.data());
+            }
+            else
+            {
+                std::copy(slot.Image.ScratchData, slot.Image.ScratchData + slot.Frame.size(), slot.Frame.begin());
+            }
+
+            graded[index] = true;
+        });
+
+        for (int i = 0; i < slot_count; ++i)
+        {
+            if (!graded[i])
+            {
+                fprintf(stderr, "Failed to load the grain of frame %d, %s\n", frame_count + i, FilmGrain[Image::GrainIndexForFrame(options.Seed, frame_count + i)]);
+                fflush(stdout);
+                return EXIT_FAILURE;
+            }
+
+            if (!Video::WriteFrame(stdout, stream, slots[i].Frame.data()))
+            {
+                fprintf(stderr, "Failed to write frame %d\n", frame_count + i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        frame_count += slot_count;
+
+        if (end) break;
+    }
+
+    res = fflush(stdout) == 0 && res;
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // stdout carries the frames
+    fprintf(stderr, "%d frames in %.2f s, %.2f fps\n", frame_count, elapsed, frame_count / elapsed);
+
+    return res ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int WatchDirectory(CLIOptions options)
+{
+    if (!options.ImageProfile || !options.ImageOutput)
+    {
+        fprintf(stderr, "--watch needs --profile and an --output directory\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<ProcessJob> profile_jobs;
+
+    for (const auto& profile : SplitList(options.ImageProfile, ','))
+    {
+        ProcessJob job;
+        job.Profile = profile;
+        profile_jobs.push_back(job);
+    }
 
-    bool res = Image::LoadImage(options.ImageInput, image.Data);
+    if (!LoadJobProfiles(profile_jobs, options)) return EXIT_FAILURE;
 
-    if (!res) return EXIT_FAILURE;
+    BatchDesc batch;
+    InitializeBatch(options, batch);
 
+    // Results are written to a staging directory and renamed into the output
+    // directory once complete, consumers never see partial files
+    std::string output_directory(options.ImageOutput);
+    std::string staging_directory = output_directory + "/.staging";
+
+    mkdir(output_directory.c_str(), 0755);
+    mkdir(staging_directory.c_str(), 0755);
+
+    bool res = Watch::Run(options.Watch, [&](const std::string& path)
+    {
+        std::vector<ProcessJob> jobs = profile_jobs;
+        std::vector<std::string> outputs;
+
+        for (auto& job : jobs)
+        {
+            // The input extension is kept, a.jpg and a.png arriving together
+            // would otherwise both write a.png
+            std::string name = FileName(path);
+
+            if (jobs.size() > 1) name += "-" + FileStem(job.Profile);
+
+            job.Output = staging_directory + "/" + name + ".png";
+
+            outputs.push_back(name + ".png");
+
+            for (int size : batch.RenditionSizes)
+            {
+                outputs.push_back(RenditionPath(name + ".png", size));
+            }
+        }
+
+        bool processed = ProcessInput(path.c_str(), jobs, batch);
+
+        for (const auto& output : outputs)
+        {
+            std::string staged = staging_directory + "/" + output;
+
+            if (processed)
+            {
+                processed = rename(staged.c_str(), (output_directory + "/" + output).c_str()) == 0;
+            }
+            else
+            {
+                unlink(staged.c_str());
+            }
+        }
+
+        return processed;
+    });
+
+    return res ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int RenderContactSheet(CLIOptions options)
+{
     Image::ProcessParams process_params;
 
-    res = Image::LoadProfile(options.ImageProfile, process_params);
+    if (options.ImageProfile)
+    {
+        auto profiles = SplitList(options.ImageProfile, ',');
 
-    if (!res) return EXIT_FAILURE;
+        if (profiles.empty() || !Image::LoadProfile(profiles[0].c_str(), process_params)) return EXIT_FAILURE;
+    }
 
-    float rand_0_1 = (float)rand() / RAND_MAX;
-    int rand_index = rand_0_1 * (ARRAYSIZE(FilmGrain) - 1);
+    Image::ParsePrecision(options.Precision, process_params.Precision);
+    process_params.Memoize = options.Memoize;
 
-    process_params.CPUPipeline = true;
-    process_params.GrainFile = FilmGrain[rand_index];
+    Image::ImageData image_data;
 
-    Image::ProcessImage(image, process_params);
-    
-    res = Image::SaveImage(options.ImageOutput, image);
+    if (!Image::LoadImage(options.ImageInput, image_data)) return EXIT_FAILURE;
 
-    Image::FreeImage(image.Data);
+    bool res = ContactSheet::Render(image_data, process_params, options.ContactSheet, options.ThumbnailSize);
 
-    return res;
+    Image::FreeImage(image_data);
+
+    return res ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Signatures of LUTs[], from the --look-index file when it is up to date
+bool AcquireLookIndex(const CLIOptions& options, LookIndex::IndexDesc& index)
+{
+    if (options.LookIndex) LookIndex::Load(options.LookIndex, index);
+
+    int taken = LookIndex::Update(index, LUTs, ARRAYSIZE(LUTs));
+
+    return !options.LookIndex || taken == 0 || LookIndex::Save(options.LookIndex, index);
+}
+
+// Lists the LUTs closest to LUTs[options.Similar], or to the look turning
+// --input into options.MatchLook
+int FindLooks(CLIOptions options)
+{
+    LookIndex::IndexDesc index;
+
+    if (!AcquireLookIndex(options, index)) return EXIT_FAILURE;
+
+    std::vector<float> signature(LookIndex::SignatureSize);
+    std::vector<float> weights;
+    int exclude = -1;
+
+    if (options.MatchLook)
+    {
+        Image::ImageData before, after;
+
+        if (!Image::LoadImage(options.ImageInput, before)) return EXIT_FAILURE;
+
+        if (!Image::LoadImage(options.MatchLook, after))
+        {
+            Image::FreeImage(before);
+            return EXIT_FAILURE;
+        }
+
+        weights.resize(LookIndex::SignatureSize);
+
+        bool res = LookIndex::PairSignature(before, after, signature.data(), weights.data());
+
+        Image::FreeImage(before);
+        Image::FreeImage(after);
+
+        if (!res) return EXIT_FAILURE;
+    }
+    else
+    {
+        exclude = options.Similar < ARRAYSIZE(LUTs) ? LookIndex::Find(index, LUTs[options.Similar]) : -1;
+
+        if (exclude < 0)
+        {
+            fprintf(stderr, "No indexed LUT %d\n", options.Similar);
+            return EXIT_FAILURE;
+        }
+
+        std::copy_n(&index.Signatures[(size_t)exclude * LookIndex::SignatureSize], LookIndex::SignatureSize, signature.begin());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto matches = LookIndex::Nearest(index, signature.data(), weights.empty() ? nullptr : weights.data(), options.Top, exclude);
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%4s %8s %5s %s\n", "rank", "delta-E", "index", "lut");
+
+    for (size_t i = 0; i < matches.size(); ++i)
+    {
+        const std::string& path = index.Paths[matches[i].Entry];
+        int lut_index = (int)(std::find(LUTs, LUTs + ARRAYSIZE(LUTs), path) - LUTs);
+
+        printf("%4zu %8.2f %5d %s\n", i + 1, matches[i].Distance, lut_index, path.c_str());
+    }
+
+    printf("\n%zu looks searched in %.3f ms\n", index.Paths.size(), elapsed);
+
+    return EXIT_SUCCESS;
+}
+
+// Fits the look turning --input into options.FitLook, as a LUT written to
+// options.FitLUT and as a profile of the existing looks written to
+// options.FitProfile
+int FitLook(CLIOptions options)
+{
+    Image::ImageData before, after;
+
+    if (!Image::LoadImage(options.ImageInput, before)) return EXIT_FAILURE;
+
+    if (!Image::LoadImage(options.FitLook, after))
+    {
+        Image::FreeImage(before);
+        return EXIT_FAILURE;
+    }
+
+    bool res = true;
+
+    if (options.FitLUT)
+    {
+        LookFit::FitOptions fit_options;
+        fit_options.Level = options.FitLevel;
+
+        Image::LUTDesc lut;
+        auto start = std::chrono::steady_clock::now();
+
+        res = LookFit::FitLUT(before, after, fit_options, lut) && Image::SaveLUT(options.FitLUT, lut);
+
+        if (res)
+        {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            Image::ProcessParams process_params;
+            process_params.Filters = Image::ProcessFilterLUT;
+
+            printf("lut %s, level %d, mean delta-E %.2f, fitted in %.2f s\n", options.FitLUT, lut.Level, LookFit::MeanDeltaE(before, after, process_params, lut), elapsed);
+        }
+    }
+
+    if (res && options.FitProfile)
+    {
+        LookIndex::IndexDesc index;
+        Image::ProcessParams process_params;
+        float error = 0.0f;
+        auto start = std::chrono::steady_clock::now();
+
+        res = AcquireLookIndex(options, index) && LookFit::FitProfile(before, after, index, process_params, error) && Image::SaveProfile(options.FitProfile, process_params);
+
+        if (res)
+        {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            printf("profile %s, lut %d", options.FitProfile, process_params.LUTIndex);
+
+            for (const Image::ChainedLUT& chained : process_params.LUTChain)
+            {
+                printf(" + lut %d at %.2f", chained.LUTIndex, chained.Strength);
+            }
+
+            printf(", mean delta-E %.2f, fitted in %.2f s\n", error, elapsed);
+        }
+    }
+
+    Image::FreeImage(before);
+    Image::FreeImage(after);
+
+    return res ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, const char** argv)
 {
-    CLIOptions options;
+    CLIOptions options = {};
+    options.ThumbnailSize = 160;
+    options.CacheSize = 1024;
+    options.Precision = "exact";
+    options.Similar = -1;
+    options.Top = 5;
+    options.FitLevel = 5;
+    options.FrameStart = 1;
 
     flag_usage("[options]");
 
     flag_string(&options.ImageInput, "input", "Image path to process");
-    flag_string(&options.ImageProfile, "profile", "Image profile params");
-    flag_string(&options.ImageOutput, "output", "Image path result");
+    flag_string(&options.ImageProfile, "profile", "Image profile params, comma separated for several");
+    flag_string(&options.ImageOutput, "output", "Image path result, one per profile");
+    flag_string(&options.ProfileList, "profile-list", "File of 'profile output' lines to render");
+    flag_string(&options.RenditionSizes, "sizes", "Extra output sizes in pixels, e.g. 2048,1024,256");
+
+    flag_string(&options.ContactSheet, "contact-sheet", "Directory to render every LUT as thumbnails into");
+    flag_int(&options.ThumbnailSize, "thumb-size", "Contact sheet thumbnail size in pixels");
 
-    flag_parse(argc, argv, "v" "0.1.0", 0);
+    flag_string(&options.CacheDirectory, "cache", "Result cache directory, reused for unchanged image and profile pairs");
+    flag_int(&options.CacheSize, "cache-size", "Result cache size limit in MB");
+    flag_int(&options.Seed, "seed", "Seed selecting the film grain frame");
 
-    if (ValidateOptions(options))
+    flag_string(&options.Watch, "watch", "Spool directory to process files from as they arrive, into the --output directory");
+
+    flag_string(&options.Sequence, "sequence", "Numbered frames to process, e.g. shot-%04d.png, into the --output frame pattern");
+    flag_int(&options.FrameStart, "frame-start", "First frame number of --sequence");
+    flag_int(&options.FrameCount, "frame-count", "Frames of --sequence to process, all up to the first missing one by default");
+
+    flag_string(&options.Filter, "filter", "Grade a y4m, rgb24 or rgba frame stream from stdin to stdout");
+    flag_string(&options.FrameSize, "frame-size", "Frame size of rgb24 and rgba streams, e.g. 1920x1080");
+
+    flag_string(&options.Precision, "precision", "Pixel pipeline precision, exact, balanced, fast or fixed");
+    flag_bool(&options.Greyscale, "greyscale", "Write outputs whose pixels are all grey as greyscale PNGs");
+    flag_bool(&options.Memoize, "memoize", "Reuse colour results for repeated input colours, for flat artwork and screenshots");
+    flag_string(&options.LUTBudget, "lut-budget", "Load LUTs onto the smallest lattice within this delta-E of the original, e.g. 0.5");
+
+    flag_string(&options.LookIndex, "look-index", "Look signature index file, built or refreshed by --similar and --match-look");
+    flag_int(&options.Similar, "similar", "List the looks closest to this index in LUTs[]");
+    flag_string(&options.MatchLook, "match-look", "List the looks closest to the edit turning --input into this image");
+    flag_int(&options.Top, "top", "Number of looks listed by --similar and --match-look");
+
+    flag_string(&options.FitLook, "fit-look", "Fit the look turning --input into this image, into --fit-lut and --fit-profile");
+    flag_string(&options.FitLUT, "fit-lut", "Hald CLUT image path for the look fitted by --fit-look");
+    flag_string(&options.FitProfile, "fit-profile", "Profile path for the blend of existing looks fitted by --fit-look");
+    flag_int(&options.FitLevel, "fit-level", "Hald level of the --fit-lut lattice, level * level points per axis");
+
+    flag_string(&options.Trace, "trace", "Write a Chrome trace of the processing stages to this path");
+
+    flag_parse(argc, argv, "v" DSIP_VERSION, 0);
+
+    Image::ProcessPrecision precision;
+
+    if (!Image::ParsePrecision(options.Precision, precision))
     {
-        return Process(options);
+        fprintf(stderr, "Unknown precision %s, expected exact, balanced, fast or fixed\n", options.Precision);
+        return EXIT_FAILURE;
     }
 
+    if (options.LUTBudget) Image::SetLUTErrorBudget((float)atof(options.LUTBudget));
+
+    if (options.Trace) Trace::Enable();
+
+    int res = EXIT_SUCCESS;
+
+    if (options.Watch)
+    {
+        res = WatchDirectory(options);
+    }
+    else if (options.Sequence)
+    {
+        res = ProcessSequence(options);
+    }
+    else if (options.Filter)
+    {
+        res = FilterVideo(options);
+    }
+    else if (options.ImageInput && options.FitLook)
+    {
+        res = FitLook(options);
+    }
+    else if (options.Similar >= 0 || (options.ImageInput && options.MatchLook))
+    {
+        res = FindLooks(options);
+    }
+    else if (options.ImageInput && options.ContactSheet)
+    {
+        res = RenderContactSheet(options);
+    }
+    else if (ValidateOptions(options))
+    {
+        res = Process(options);
+    }
+    else
+    {
 #ifdef DSIP_GUI
-    Window window(800, 800);
-    window.Initialize();
-    window.Show();
+        Window window(800, 800);
+        window.Initialize();
+        window.Show();
 #endif
+    }
 
-    return EXIT_SUCCESS;
+    if (options.Trace && !Trace::Write(options.Trace))
+    {
+        fprintf(stderr, "Failed to write trace %s\n", options.Trace);
+        res = EXIT_FAILURE;
+    }
+
+    return res;
 }